@@ -0,0 +1,271 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Verify and measure multiplex and pixel mappers for a panel geometry
+// (--led-rows, --led-cols, --led-chain, --led-parallel).
+//
+// Every multiplexer and every registered pixel mapper (with its default
+// parameter, on top of --led-multiplexing) is applied, as well as the
+// pixel mapper configurations given on the command line. For each it is
+// checked that each LED is reached by exactly one visible pixel; mappers
+// with gaps (such as File) show them as missing LEDs.
+//
+// Reported are the time to build the mapping as done on startup, the
+// structure of the result in runs of pixels with constant stride (see
+// PixelRun; stride 1 runs are the fastest for SetPixels()) and the
+// resulting SetPixels() throughput.
+//
+// Does not access the GPIO, so it can run on any machine.
+
+#include "framebuffer-internal.h"
+#include "led-matrix.h"
+#include "multiplex-mappers-internal.h"
+#include "pixel-mapper.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+using rgb_matrix::Color;
+using rgb_matrix::PixelMapper;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::internal::Framebuffer;
+using rgb_matrix::internal::MultiplexMapper;
+using rgb_matrix::internal::PixelDesignator;
+using rgb_matrix::internal::PixelDesignatorMap;
+using rgb_matrix::internal::PixelRun;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] [<pixel-mapper-config>...]\n",
+          progname);
+  fprintf(stderr, "Verify and benchmark multiplex and pixel mappers.\n");
+  fprintf(stderr, "Options:\n"
+          "\t-n <frames>     : Frames to set to measure SetPixels() "
+          "(Default: 20)\n"
+          "\t-q              : Only show mappers that are not 1:1\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+static int64_t GetNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Pixel mappers from a --led-pixel-mapper style configuration. Mappers that
+// can't be found or configured are NULL.
+static std::vector<const PixelMapper*> ParseMappers(const char *config,
+                                                    int chain, int parallel) {
+  std::vector<const PixelMapper*> result;
+  std::string spec(config);
+  size_t start = 0;
+  while (start <= spec.size()) {
+    size_t end = spec.find(';', start);
+    if (end == std::string::npos) end = spec.size();
+    std::string name = spec.substr(start, end - start);
+    start = end + 1;
+    if (name.empty()) continue;
+    std::string param;
+    const size_t colon = name.find(':');
+    if (colon != std::string::npos) {
+      param = name.substr(colon + 1);
+      name.resize(colon);
+    }
+    result.push_back(rgb_matrix::FindPixelMapper(name.c_str(), chain,
+                                                 parallel, param.c_str()));
+  }
+  return result;
+}
+
+struct Result {
+  bool applied;
+  int width, height;
+  double build_ms;
+  int duplicates;  // LEDs reached by more than one pixel.
+  int missing;     // LEDs not reached.
+  int runs;
+  double stride1_percent;  // Pixels in runs with stride 1.
+  double mpixel_per_sec;   // SetPixels() of full frames.
+};
+
+// Apply "mappers" to the physical layout of "rows" x "cols" panels and
+// examine the result.
+static Result Examine(const RGBMatrix::Options &options, int rows, int cols,
+                      const std::vector<const PixelMapper*> &mappers,
+                      int frames) {
+  Result r;
+  memset(&r, 0, sizeof(r));
+  Framebuffer framebuffer(rows, cols * options.chain_length,
+                          options.parallel, 0, "RGB", false, NULL);
+  const PixelDesignatorMap &physical = *framebuffer.pixel_mapper();
+
+  const int64_t start = GetNanoseconds();
+  r.applied = true;
+  std::shared_ptr<PixelDesignatorMap> mapped(
+    rgb_matrix::internal::CreateMappedPixels(physical, mappers, &r.applied));
+  r.build_ms = (GetNanoseconds() - start) / 1e6;
+  if (mapped == NULL) mapped = framebuffer.pixel_mapper();
+  r.width = mapped->width();
+  r.height = mapped->height();
+
+  // Each LED has a unique designator; count how often each is used.
+  std::vector<uint64_t> used;
+  used.reserve((size_t)r.width * r.height);
+  for (int y = 0; y < r.height; ++y) {
+    for (int x = 0; x < r.width; ++x) {
+      const PixelDesignator *d = mapped->get(x, y);
+      if (d->gpio_word == PixelDesignator::kUnused) continue;
+      used.push_back((uint64_t)d->gpio_word << 32 | d->color_bits);
+    }
+  }
+  std::sort(used.begin(), used.end());
+  const size_t distinct = std::unique(used.begin(), used.end()) - used.begin();
+  r.duplicates = used.size() - distinct;
+  r.missing = physical.width() * physical.height() - distinct;
+
+  int64_t stride1_pixels = 0, shown = 0;
+  for (int y = 0; y < r.height; ++y) {
+    int count;
+    const PixelRun *run = mapped->GetRowRuns(y, &count);
+    for (int i = 0; i < count; ++i) {
+      if (run[i].stride == 1 || run[i].length == 1)
+        stride1_pixels += run[i].length;
+      shown += run[i].length;
+    }
+  }
+  r.runs = mapped->run_count();
+  r.stride1_percent = shown ? 100.0 * stride1_pixels / shown : 0;
+
+  framebuffer.SetPixelMapper(mapped);
+  std::vector<Color> image((size_t)r.width * r.height);
+  for (size_t i = 0; i < image.size(); ++i) {
+    image[i] = Color(i, i >> 3, i >> 6);
+  }
+  const int64_t set_start = GetNanoseconds();
+  for (int f = 0; f < frames; ++f) {
+    framebuffer.SetPixels(0, 0, r.width, r.height, image.data());
+  }
+  r.mpixel_per_sec = (double)image.size() * frames * 1e3
+    / (GetNanoseconds() - set_start);
+  return r;
+}
+
+static void PrintResult(const char *name, const Result &r, bool only_errors) {
+  const bool ok = r.applied && r.duplicates == 0 && r.missing == 0;
+  if (only_errors && ok) return;
+  if (!r.applied) {
+    printf("%-40s %s\n", name, "not applicable to this geometry");
+    return;
+  }
+  char size[32];
+  snprintf(size, sizeof(size), "%dx%d", r.width, r.height);
+  printf("%-40s %10s %9.2f %6d %6d %7d %8.1f %7.1f %10.1f\n",
+         name, size, r.build_ms, r.duplicates, r.missing, r.runs,
+         r.runs ? (double)r.width * r.height / r.runs : 0,
+         r.stride1_percent, r.mpixel_per_sec);
+  fflush(stdout);  // Keep in order with mapper errors on stderr.
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+  int frames = 20;
+  bool only_errors = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:q")) != -1) {
+    switch (opt) {
+    case 'n': frames = atoi(optarg); break;
+    case 'q': only_errors = true; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (frames < 1) return usage(argv[0]);
+
+  Framebuffer::InitHardwareMapping(matrix_options.hardware_mapping);
+  const int chain = matrix_options.chain_length;
+  const int parallel = matrix_options.parallel;
+  printf("Panels %dx%d, chain %d, parallel %d\n",
+         matrix_options.cols, matrix_options.rows, chain, parallel);
+  printf("%-40s %10s %9s %6s %6s %7s %8s %7s %10s\n", "mapper", "size",
+         "build-ms", "dup", "miss", "runs", "px/run", "%str-1",
+         "SetPixels");
+
+  // Each multiplexer on its own. They change the physical panel layout.
+  const rgb_matrix::internal::MuxMapperList &muxers =
+    rgb_matrix::internal::GetRegisteredMultiplexMappers();
+  for (int m = 0; m <= (int)muxers.size(); ++m) {
+    int rows = matrix_options.rows;
+    int cols = matrix_options.cols;
+    std::vector<const PixelMapper*> mappers;
+    char name[64];
+    if (m == 0) {
+      snprintf(name, sizeof(name), "(none)");
+    } else {
+      const MultiplexMapper *mux = muxers[m - 1];
+      mux->EditColsRows(&cols, &rows);
+      mappers.push_back(mux);
+      snprintf(name, sizeof(name), "mux %d %s", m, mux->GetName());
+    }
+    if (rows < 4 || rows > 64 || rows % 2 != 0) {
+      if (!only_errors)
+        printf("%-40s panel of %d rows not possible\n", name, rows);
+      continue;
+    }
+    PrintResult(name, Examine(matrix_options, rows, cols, mappers, frames),
+                only_errors);
+  }
+
+  // Pixel mappers on top of the chosen multiplexing.
+  int rows = matrix_options.rows;
+  int cols = matrix_options.cols;
+  const MultiplexMapper *mux = NULL;
+  if (matrix_options.multiplexing > 0
+      && matrix_options.multiplexing <= (int)muxers.size()) {
+    mux = muxers[matrix_options.multiplexing - 1];
+    mux->EditColsRows(&cols, &rows);
+  }
+  std::vector<std::string> configs = rgb_matrix::GetAvailablePixelMappers();
+  for (int i = optind; i < argc; ++i) configs.push_back(argv[i]);
+  for (size_t i = 0; i < configs.size(); ++i) {
+    std::vector<const PixelMapper*> mappers(1, mux);
+    const std::vector<const PixelMapper*> named
+      = ParseMappers(configs[i].c_str(), chain, parallel);
+    if (std::find(named.begin(), named.end(), (const PixelMapper*)NULL)
+        != named.end()) {
+      if (!only_errors)
+        printf("%-40s %s\n", configs[i].c_str(), "can't configure");
+      continue;
+    }
+    mappers.insert(mappers.end(), named.begin(), named.end());
+    PrintResult(configs[i].c_str(),
+                Examine(matrix_options, rows, cols, mappers, frames),
+                only_errors);
+  }
+  return 0;
+}
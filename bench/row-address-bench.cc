@@ -0,0 +1,160 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Measure the time it takes to set the row address for each
+// --led-row-addr-type. During that time, the display is dark, so this
+// directly eats into the brightness and refresh rate.
+//
+// Rows are addressed in two patterns: in ascending order as the refresh
+// does, and in a scrambled order that always needs the full sequence.
+
+#include "framebuffer-internal.h"
+#include "gpio.h"
+#include "hardware-mapping.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using rgb_matrix::GPIO;
+using rgb_matrix::internal::CreateRowAddressSetter;
+using rgb_matrix::internal::RowAddressSetter;
+
+static const char *kRowAddressTypeNames[] = {
+  "direct", "AB-shift", "direct-row-select", "ABC-shift", "SM5266",
+};
+static const int kRowAddressTypes = 5;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Benchmark the row address setters. Needs to run as root "
+          "on a Raspberry Pi.\n");
+  fprintf(stderr, "Options:\n"
+          "\t-r <rows>       : Panel rows (Default: 32)\n"
+          "\t-m <mapping>    : Hardware mapping (Default: regular)\n"
+          "\t-s <slowdown>   : GPIO slowdown (Default: 1)\n"
+          "\t-t <type>       : Only benchmark this row address type.\n"
+          "\t-n <iterations> : Refreshes to measure (Default: 10000)\n");
+  return 1;
+}
+
+static int64_t GetNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int Gcd(int a, int b) {
+  return b == 0 ? a : Gcd(b, a % b);
+}
+
+// Address all rows in the given order "iterations" times and return the
+// nanoseconds per row.
+static double MeasureRows(GPIO *io, RowAddressSetter *setter,
+                          const int *order, int double_rows,
+                          int iterations) {
+  const int64_t start = GetNanoseconds();
+  for (int i = 0; i < iterations; ++i) {
+    for (int r = 0; r < double_rows; ++r) {
+      setter->SetRowAddress(io, order[r]);
+    }
+  }
+  const int64_t duration = GetNanoseconds() - start;
+  return 1.0 * duration / (1LL * iterations * double_rows);
+}
+
+int main(int argc, char *argv[]) {
+  int rows = 32;
+  const char *mapping_name = "regular";
+  int slowdown = 1;
+  int only_type = -1;
+  int iterations = 10000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:m:s:t:n:")) != -1) {
+    switch (opt) {
+    case 'r': rows = atoi(optarg); break;
+    case 'm': mapping_name = strdup(optarg); break;
+    case 's': slowdown = atoi(optarg); break;
+    case 't': only_type = atoi(optarg); break;
+    case 'n': iterations = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  const int double_rows = rows / 2;
+  if (double_rows < 2 || double_rows > 32 || iterations < 1
+      || only_type >= kRowAddressTypes) {
+    return usage(argv[0]);
+  }
+
+  const struct HardwareMapping *mapping = NULL;
+  for (const HardwareMapping *it = matrix_hardware_mappings; it->name; ++it) {
+    if (strcasecmp(it->name, mapping_name) == 0) {
+      mapping = it;
+      break;
+    }
+  }
+  if (mapping == NULL) {
+    fprintf(stderr, "There is no hardware mapping named '%s'\n",
+            mapping_name);
+    return 1;
+  }
+
+  GPIO io;
+  if (!io.Init(slowdown)) {
+    fprintf(stderr, "Can't initialize GPIO; need to run as root on a Pi.\n");
+    return 1;
+  }
+
+  // Scrambled: step through the rows with a stride co-prime to the number
+  // of rows, which is a permutation that never goes to the next row. A
+  // stride of 1 or double_rows - 1 would just go up or down row by row; with
+  // few rows, there is no other, so only ascending is measured.
+  int stride = double_rows / 2 + 1;
+  while (stride < double_rows - 1 && Gcd(stride, double_rows) != 1) ++stride;
+  const bool has_scrambled = (stride < double_rows - 1);
+  int ascending[32];
+  int scrambled[32];
+  for (int r = 0; r < double_rows; ++r) {
+    ascending[r] = r;
+    scrambled[r] = (r * stride) % double_rows;
+  }
+
+  printf("%d rows, mapping '%s', slowdown %d\n",
+         rows, mapping->name, slowdown);
+  printf("%-20s %14s %14s\n", "row-addr-type", "ascending ns", "scrambled ns");
+  for (int type = 0; type < kRowAddressTypes; ++type) {
+    if (only_type >= 0 && type != only_type) continue;
+    RowAddressSetter *setter = CreateRowAddressSetter(type, double_rows,
+                                                      *mapping);
+    io.InitOutputs(setter->need_bits());
+    const double asc_ns = MeasureRows(&io, setter, ascending, double_rows,
+                                      iterations);
+    printf("%d %-18s %14.1f", type, kRowAddressTypeNames[type], asc_ns);
+    if (has_scrambled) {
+      printf(" %14.1f\n", MeasureRows(&io, setter, scrambled, double_rows,
+                                      iterations));
+    } else {
+      printf(" %14s\n", "-");
+    }
+    delete setter;
+  }
+  return 0;
+}
@@ -0,0 +1,172 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Measure SetPixel() throughput for a given panel configuration (all the
+// --led- flags apply, e.g. --led-chain, --led-parallel, --led-pixel-mapper).
+//
+// Pixels are set row by row, column by column and in random order; the
+// latter two are what drawing lines, text or sprites looks like to the
+// caches. Where the kernel allows (see /proc/sys/kernel/perf_event_paranoid)
+// the cache misses per pixel are reported as well.
+//
+// Does not access the GPIO, so it can run on any machine.
+
+#include "framebuffer-internal.h"
+#include "graphics.h"
+#include "led-matrix.h"
+
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+using rgb_matrix::Color;
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::RGBMatrix;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Benchmark setting pixels.\n");
+  fprintf(stderr, "Options:\n"
+          "\t-n <frames>     : Full frames to set per pattern (Default: 50)\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+static int64_t GetNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns a file descriptor to count cache misses of this process or -1
+// if not available.
+static int OpenCacheMissCounter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct Point {
+  int x, y;
+};
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+  int frames = 50;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n': frames = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (frames < 1) return usage(argv[0]);
+
+  runtime_opt.do_gpio_init = false;
+  runtime_opt.daemon = -1;
+  runtime_opt.drop_privileges = -1;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options,
+                                                   runtime_opt);
+  if (matrix == NULL) return 1;
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+  const size_t pixels = (size_t)width * height;
+
+  // Access patterns.
+  std::vector<Point> rows, columns, random;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) rows.push_back({x, y});
+  }
+  for (int x = 0; x < width; ++x) {
+    for (int y = 0; y < height; ++y) columns.push_back({x, y});
+  }
+  random = rows;
+  srandom(42);
+  for (size_t i = random.size() - 1; i > 0; --i) {
+    std::swap(random[i], random[::random() % (i + 1)]);
+  }
+  std::vector<Color> image(pixels);
+  for (size_t i = 0; i < pixels; ++i) image[i] = Color(i, i >> 3, i >> 6);
+
+  // Each GPIO word holds the bits of two rows of each parallel chain.
+  const size_t buffer_bytes = pixels / (2 * matrix_options.parallel)
+    * rgb_matrix::internal::Framebuffer::kBitPlanes * sizeof(gpio_bits_t);
+  printf("%dx%d; designator map %.2f MiB (%d bytes/pixel), "
+         "framebuffer ~%.2f MiB\n", width, height,
+         pixels * sizeof(rgb_matrix::internal::PixelDesignator) / 1048576.0,
+         (int)sizeof(rgb_matrix::internal::PixelDesignator),
+         buffer_bytes / 1048576.0);
+
+  const int counter = OpenCacheMissCounter();
+  printf("%-12s %12s %18s\n", "pattern", "Mpixel/s", "cache-miss/pixel");
+  const char *names[] = { "rows", "columns", "random", "SetPixels" };
+  const std::vector<Point> *patterns[] = { &rows, &columns, &random, NULL };
+  for (int p = 0; p < 4; ++p) {
+    if (counter >= 0) {
+      ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    const int64_t start = GetNanoseconds();
+    for (int f = 0; f < frames; ++f) {
+      if (patterns[p] == NULL) {
+        canvas->SetPixels(0, 0, width, height, image.data());
+        continue;
+      }
+      const uint8_t v = f;
+      for (const Point &pt : *patterns[p]) {
+        canvas->SetPixel(pt.x, pt.y, v, pt.x, pt.y);
+      }
+    }
+    const int64_t duration = GetNanoseconds() - start;
+    uint64_t misses = 0;
+    if (counter >= 0) {
+      ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+        misses = 0;
+    }
+    const double total = (double)pixels * frames;
+    char miss_text[32] = "n/a";
+    if (counter >= 0) snprintf(miss_text, sizeof(miss_text), "%.3f",
+                               misses / total);
+    printf("%-12s %12.1f %18s\n", names[p], total * 1e3 / duration, miss_text);
+  }
+  if (counter >= 0) close(counter);
+
+  delete matrix;
+  return 0;
+}
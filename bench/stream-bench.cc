@@ -0,0 +1,170 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Compare the content stream payloads: the internal bitplane representation
+// against packed RGB pixels, each raw and delta-compressed.
+//
+// For each, an animation is written to memory ("write"), read back
+// frame by frame into a canvas as during playback ("play") and converted
+// to a bitplane stream as the led-image-viewer does when loading RGB
+// streams ("load"; bitplane streams need no conversion).
+//
+// Does not access the GPIO, so it can run on any machine.
+
+#include "content-streamer.h"
+#include "graphics.h"
+#include "led-matrix.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+using rgb_matrix::Color;
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::MemStreamIO;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::StreamReader;
+using rgb_matrix::StreamWriter;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Benchmark content stream formats.\n");
+  fprintf(stderr, "Options:\n"
+          "\t-n <frames>     : Frames in the animation (Default: 200)\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+static int64_t GetNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Something that moves, with some parts of the image staying the same, so
+// that delta compression has something to do, but not too easy.
+static void CreateFrame(int frame, int width, int height,
+                        std::vector<Color> *pixels) {
+  pixels->resize(width * height);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      Color &c = (*pixels)[y * width + x];
+      if (y < height / 2) {
+        c = Color(x * 255 / width, y * 255 / height, 128);  // static
+      } else {
+        const float v = sinf((x + frame) * 0.2f) * cosf((y - frame) * 0.15f);
+        c = Color(128 + 127 * v, 128 - 127 * v, (x * y + frame) & 0xff);
+      }
+    }
+  }
+}
+
+static double MillisSince(int64_t start) {
+  return (GetNanoseconds() - start) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+  int frames = 200;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n': frames = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (frames < 1) return usage(argv[0]);
+
+  runtime_opt.do_gpio_init = false;
+  runtime_opt.daemon = -1;
+  runtime_opt.drop_privileges = -1;
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options,
+                                                   runtime_opt);
+  if (matrix == NULL) return 1;
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+
+  std::vector<std::vector<Color> > animation(frames);
+  for (int f = 0; f < frames; ++f) {
+    CreateFrame(f, width, height, &animation[f]);
+  }
+
+  printf("%dx%d, %d frames\n", width, height, frames);
+  printf("%-20s %10s %10s %12s %12s\n", "format", "MiB", "write ms",
+         "play fps", "load ms");
+  for (int format = 0; format < 4; ++format) {
+    const bool rgb = format >= 2;
+    const bool compress = format % 2;
+
+    // Rendering the bitplanes is part of writing them.
+    MemStreamIO stream;
+    StreamWriter writer(&stream, compress);
+    writer.SetWriteBuffering(true);
+    int64_t start = GetNanoseconds();
+    for (int f = 0; f < frames; ++f) {
+      if (rgb) {
+        writer.StreamRGB(animation[f].data(), width, height, 1000);
+      } else {
+        canvas->SetPixels(0, 0, width, height, animation[f].data());
+        writer.Stream(*canvas, 1000);
+      }
+    }
+    writer.Flush();
+    const double write_ms = MillisSince(start);
+
+    StreamReader reader(&stream);
+    start = GetNanoseconds();
+    int played = 0;
+    while (reader.GetNext(canvas, NULL)) ++played;
+    const double play_fps = played * 1e3 / MillisSince(start);
+
+    double load_ms = 0;
+    if (rgb) {
+      reader.Rewind();
+      MemStreamIO converted;
+      StreamWriter out(&converted);
+      uint32_t hold_time_us;
+      start = GetNanoseconds();
+      while (reader.GetNext(canvas, &hold_time_us)) {
+        out.Stream(*canvas, hold_time_us);
+      }
+      load_ms = MillisSince(start);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "%s%s", rgb ? "rgb" : "bitplanes",
+             compress ? " compressed" : "");
+    printf("%-20s %10.2f %10.1f %12.1f %12.1f\n", name,
+           stream.Size() / (1024.0 * 1024.0), write_ms, play_fps, load_ms);
+    if (played != frames) {
+      fprintf(stderr, "%s: only read %d frames\n", name, played);
+    }
+  }
+
+  delete matrix;
+  return 0;
+}
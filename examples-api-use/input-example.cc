@@ -45,14 +45,25 @@ int main(int argc, char *argv[]) {
   }
   fprintf(stderr, "\n");
 
+  // Ignore bouncing of mechanical buttons for 20ms after each change.
+  matrix->SetInputDebounce(available_inputs, 20000);
+
+  RGBMatrix::InputEvent events[16];
   while (!interrupt_received) {
       // Block and wait until any input bit changed or 100ms passed
-      uint32_t inputs = matrix->AwaitInputChange(100);
+      const int count = matrix->ReadInputEvents(events, 16, 100);
 
       // Minimal output: let's show the bits with LEDs in the first row
-      for (int b = 0; b < 32; ++b) {
-          uint8_t col = (inputs & (1<<b)) ? 255 : 0;
-          matrix->SetPixel(32-b, 0, col, col, col);
+      for (int i = 0; i < count; ++i) {
+          const RGBMatrix::InputEvent &e = events[i];
+          fprintf(stderr, "%llu.%06llu: GPIO %d -> %d\n",
+                  (unsigned long long)(e.timestamp_us / 1000000),
+                  (unsigned long long)(e.timestamp_us % 1000000),
+                  e.gpio, e.value);
+          if (e.gpio < 32) {
+              uint8_t col = e.value ? 255 : 0;
+              matrix->SetPixel(32-e.gpio, 0, col, col, col);
+          }
       }
   }
 
@@ -0,0 +1,54 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Example of a producer for the display server (utils/led-display-server):
+// writes an animation into its shared memory frame ring. Does not need to
+// run as root or know the panel configuration.
+//
+// This code is public domain
+// (but note, that the led-matrix library this depends on is GPL v2)
+
+#include "graphics.h"
+#include "shm-frame-ring.h"
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+using rgb_matrix::Color;
+using rgb_matrix::ShmFrameRing;
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+int main(int argc, char *argv[]) {
+  const char *name = (argc > 1) ? argv[1] : "/rgbmatrix";
+  ShmFrameRing *ring = ShmFrameRing::Attach(name);
+  if (ring == NULL) {
+    fprintf(stderr, "usage: %s [<shared-memory-name>]\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  const int width = ring->width();
+  const int height = ring->height();
+  for (int frame = 0; !interrupt_received; ++frame) {
+    // Pixels go straight into shared memory, no extra copy.
+    Color *pixels = ring->BeginFrame();
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const float v = sinf((x + frame) * 0.1f) * cosf((y - frame) * 0.07f);
+        pixels[y * width + x] = Color(128 + 127 * v, 128 - 127 * v,
+                                      (x + y + frame) & 0xff);
+      }
+    }
+    ring->PublishFrame();
+    usleep(1000000 / 60);
+  }
+
+  delete ring;
+  return 0;
+}
@@ -6,7 +6,11 @@
 // the Pi to avoid stuttering or brightness glitches.
 //
 // The disadvantage is, that this represents the full expanded internal
-// representation of a frame, so is very large memory wise.
+// representation of a frame, so is very large memory wise. Streams can be
+// written with inter-frame delta compression to mitigate that (see
+// StreamWriter). Alternatively, streams can contain plain RGB pixels, which
+// are smaller and work with any panel configuration, but need to be
+// converted when read (see StreamWriter::StreamRGB()).
 //
 // These abstractions are used in util/led-image-viewer.cc to read and
 // write such animations to disk. It is also used in util/video-viewer.cc
@@ -16,11 +20,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#include <deque>
 #include <string>
+#include <vector>
+
+#include "thread.h"
 
 namespace rgb_matrix {
 class FrameCanvas;
+struct Color;
 
 // An abstraction of a data stream. Two implementations exist for files and
 // an in-memory representation, but this allows your own implementation, e.g.
@@ -39,6 +49,29 @@ public:
   // Write bytes from buffer. Similar to Posix behavior that allows short
   // writes.
   virtual ssize_t Append(const void *buf, size_t count) = 0;
+
+  // Write the "count" buffers in "iov" in sequence, similar to Posix
+  // writev(). The default implementation Append()s them one by one.
+  virtual ssize_t AppendVector(const struct iovec *iov, int count);
+
+  // Optional: reserve storage so that the stream can grow to "size" bytes
+  // without fragmentation or reallocation. Does not change the size of the
+  // stream. Returns 'false' if not supported.
+  virtual bool Preallocate(off_t size) { return false; }
+
+  // Optional random access, needed for seeking in streams.
+  // Set read position to "pos" bytes from the beginning of the stream.
+  // Returns 'false' if not possible.
+  virtual bool Seek(off_t pos) { return false; }
+
+  // Size of the stream in bytes or -1 if not known.
+  virtual off_t Size() { return -1; }
+
+  // Optional zero-copy read: return a pointer to the next "count" bytes of
+  // the stream and advance past them. The memory stays valid and unchanged
+  // as long as this StreamIO exists. Returns NULL if not supported or if
+  // there are not enough bytes left.
+  virtual const char *ReadDirect(size_t count) { return NULL; }
 };
 
 class FileStreamIO : public StreamIO {
@@ -49,20 +82,53 @@ public:
   void Rewind() final;
   ssize_t Read(void *buf, size_t count) final;
   ssize_t Append(const void *buf, size_t count) final;
+  ssize_t AppendVector(const struct iovec *iov, int count) final;
+  bool Preallocate(off_t size) final;
+  bool Seek(off_t pos) final;
+  off_t Size() final;
 
 private:
   const int fd_;
 };
 
 // Storing a stream in memory. Owns the memory.
+// Memory is allocated in chunks that grow with the stream size up to
+// kMaxChunkSize, so appending never moves existing content, and
+// ReadDirect() works for everything that is within one chunk.
 class MemStreamIO : public StreamIO {
 public:
+  MemStreamIO();
+  ~MemStreamIO();
+
   void Rewind() final;
   ssize_t Read(void *buf, size_t count) final;
   ssize_t Append(const void *buf, size_t count) final;
+  bool Preallocate(off_t size) final;
+  bool Seek(off_t pos) final;
+  off_t Size() final;
+  const char *ReadDirect(size_t count) final;
+
+  // Bytes of memory allocated for this stream.
+  size_t MemoryUsage() const { return capacity_; }
+
+  static constexpr size_t kMinChunkSize = 64 << 10;
+  static constexpr size_t kMaxChunkSize = 4 << 20;
 
 private:
-  std::string buffer_;  // super simplistic.
+  MemStreamIO(const MemStreamIO &) = delete;
+  MemStreamIO &operator=(const MemStreamIO &) = delete;
+
+  struct Chunk {
+    char *data;
+    size_t start;  // Position of first byte in stream.
+    size_t size;
+  };
+  void AddChunk(size_t min_size);
+  size_t ChunkFor(size_t pos) const;
+
+  std::vector<Chunk> chunks_;
+  size_t size_;      // Bytes appended.
+  size_t capacity_;  // Bytes in all chunks.
   size_t pos_;
 };
 
@@ -81,26 +147,115 @@ public:
   // No append, this is purely read-only.
   ssize_t Append(const void *buf, size_t count) final { return -1; }
 
+  bool Seek(off_t pos) final;
+  off_t Size() final;
+  const char *ReadDirect(size_t count) final;
+
 private:
   char *buffer_;
   char *end_;
   char *pos_;
 };
 
+// Location and timing of a frame in a stream, as stored in the optional
+// frame index at the end of a stream (see StreamWriter::Finalize()).
+struct StreamFrameInfo {
+  uint64_t offset;         // Byte position of the frame in the stream.
+  uint64_t start_time_us;  // Sum of the hold times of all frames before.
+  uint32_t hold_time_us;
+  uint32_t flags;          // Internal frame flags.
+};
+
 class StreamWriter {
 public:
-  // Does not take ownership of StreamIO
-  StreamWriter(StreamIO *io);
+  // Does not take ownership of StreamIO. Each frame is in the StreamIO
+  // when Stream() returns, unless write buffering is switched on with
+  // SetWriteBuffering().
+  //
+  // Each frame is stored with a checksum, so that readers can skip frames
+  // that got corrupted on storage.
+  //
+  // If "compress" is set, each frame is stored as the difference to the
+  // previous frame, run-length encoded, with a full keyframe every
+  // kKeyframeInterval frames. Animations typically shrink to a small
+  // fraction of their size, but older readers can't play these streams.
+  StreamWriter(StreamIO *io, bool compress = false);
+  ~StreamWriter();
+
+  // Pad the stream so that the data of each uncompressed frame starts at a
+  // multiple of "alignment" bytes (a power of two up to kMaxFrameAlignment,
+  // e.g. 4096 for memory pages; 0 or 1 for none). Aligned frames can be
+  // played from memory mapped streams without copying, see
+  // StreamReader::SetZeroCopy(). Needs to be set before the first frame.
+  // Returns 'false' if the value is not supported.
+  bool SetFrameAlignment(uint32_t alignment);
+
+  // If "on", small writes are collected and written in chunks of up to
+  // kWriteBufferSize, which is a lot faster for files. Frames only end up
+  // in the StreamIO then with Flush() or Finalize() (and the destructor),
+  // and errors of the StreamIO might only be reported by a later call.
+  void SetWriteBuffering(bool on);
 
   // Stream out given canvas at the given time. "hold_time_us" indicates
-  // for how long this frame is to be shown in microseconds.
+  // for how long this frame is to be shown in microseconds. All canvases
+  // need to have the same size and configuration as the first one; returns
+  // 'false' otherwise.
   bool Stream(const FrameCanvas &frame, uint32_t hold_time_us);
 
+  // Stream out "width" x "height" packed RGB "pixels" (row by row) instead
+  // of the internal representation of a canvas. The resulting stream does
+  // not depend on the panel configuration (pwm bits, brightness, led
+  // sequence, hardware mapping, pixel mappers...) nor on the exact size of
+  // the canvas it is played on; StreamReader converts the pixels when
+  // reading. All frames need to have the same size and can't be mixed with
+  // Stream() in the same stream.
+  bool StreamRGB(const Color *pixels, int width, int height,
+                 uint32_t hold_time_us);
+
+  // Append an index of all frames written, which allows StreamReader to
+  // seek quickly. Call once after the last frame; afterwards, Stream(),
+  // StreamRGB() and Finalize() return 'false'. Streams without index
+  // still can be read (and seeked, after scanning the stream once).
+  // Flushes the stream.
+  bool Finalize();
+
+  // Write out all buffered data. Returns 'false' if writing failed.
+  bool Flush();
+
+  // Let the StreamIO reserve space for "frames" more frames like "frame",
+  // which avoids fragmentation of large files. Only possible for
+  // uncompressed streams, as otherwise the size is not known in advance.
+  // Returns 'false' if nothing was reserved.
+  bool Preallocate(const FrameCanvas &frame, int frames);
+
+  static constexpr uint32_t kKeyframeInterval = 64;
+  static constexpr uint32_t kMaxFrameAlignment = 65536;
+  static constexpr size_t kWriteBufferSize = 1 << 20;
+
 private:
-  void WriteFileHeader(const FrameCanvas &frame, size_t len);
+  bool WriteFileHeader(int width, int height, size_t len, bool is_rgb);
+  bool StreamData(const char *data, size_t len, uint32_t hold_time_us);
+  bool AppendFrame(const void *header, const void *data, size_t len);
+  bool Write(const struct iovec *iov, int count);
 
   StreamIO *const io_;
+  const bool compress_;
+  uint32_t alignment_;
   bool header_written_;
+  bool finalized_;         // Index written, no more frames.
+  bool is_rgb_;
+  int width_;
+  int height_;
+  size_t frame_size_;      // Bytes of data of each frame.
+  std::vector<char> rgb_buffer_;     // Pixels padded to full words.
+  uint32_t frame_count_;
+  uint64_t offset_;        // Bytes written so far.
+  uint64_t total_time_us_;
+  std::vector<StreamFrameInfo> index_;
+  std::vector<uint32_t> reference_;  // Previous frame if compressing.
+  std::vector<char> encode_buffer_;
+  bool buffer_writes_;
+  std::vector<char> write_buffer_;   // Not yet written to io_.
 };
 
 class StreamReader {
@@ -116,18 +271,249 @@ public:
   // or end of stream reached..
   bool GetNext(FrameCanvas *frame, uint32_t* hold_time_us);
 
+  // If enabled, and the StreamIO supports ReadDirect() (e.g.
+  // MemMapViewInput), uncompressed frames are not copied into the canvas;
+  // the canvas displays straight from the stream memory instead until it is
+  // modified or filled with other content. The StreamIO then needs to
+  // outlive the use of these canvases. Off by default.
+  void SetZeroCopy(bool enable) { zero_copy_ = enable; }
+
+  // Frames are stored with a checksum (CRC32C); corrupted frames, e.g. from
+  // bad storage sectors, are skipped instead of shown. In compressed
+  // streams, the frames up to the next keyframe are skipped as well, as
+  // they depend on it. Verifying reads all the frame data, so to save time,
+  // only every "interval"th frame can be checked; 0 disables verification.
+  // By default, all frames are checked when read by a
+  // PrefetchingStreamReader, whose thread does not hold up playback, and
+  // every kSampledChecksumInterval'th frame otherwise.
+  void SetChecksumInterval(int interval) { checksum_interval_ = interval; }
+
+  static constexpr int kSampledChecksumInterval = 16;
+
+  // Number of frames skipped so far because their checksum did not match.
+  int corrupt_frames() const { return corrupt_frames_; }
+
+  // Returns 'true' if this stream contains RGB pixels instead of the
+  // internal representation of a canvas (see StreamWriter::StreamRGB()).
+  // RGB streams can be played on any canvas: smaller frames are shown at
+  // the top left, larger ones are cropped.
+  bool IsRGB();
+
+  // -- Random access. Only possible if the StreamIO supports Seek() and
+  // Size(). Uses the index written by StreamWriter::Finalize(); if there is
+  // none, the stream is scanned once on first use to build it.
+
+  // Number of frames in the stream or -1 if it can't be determined.
+  int FrameCount();
+
+  // Total playing time of the stream in microseconds or -1 if unknown.
+  int64_t Duration();
+
+  // Position the stream so that the next GetNext() returns frame
+  // "frame_number" (counting from 0). Returns 'false' if this is not
+  // possible.
+  bool SeekToFrame(int frame_number);
+
+  // Position the stream so that the next GetNext() returns the frame that
+  // is shown "time_us" microseconds after the start of the stream. Returns
+  // the frame number or -1 if not possible.
+  int SeekToTime(int64_t time_us);
+
 private:
+  friend class StreamPlaylist;
+  friend class PrefetchingStreamReader;
+
+  // Interval used unless SetChecksumInterval() was called.
+  void SetDefaultChecksumInterval(int interval) {
+    default_checksum_interval_ = interval;
+  }
+
   enum State {
     STREAM_AT_BEGIN,
     STREAM_READING,
     STREAM_ERROR,
   };
-  bool ReadFileHeader(const FrameCanvas &frame);
+  enum FrameResult {
+    FRAME_OK,
+    FRAME_SKIPPED,  // Corrupted or not decodable; try the next one.
+    FRAME_FAILED,
+  };
+  bool ReadFileHeader();
+  bool CheckGeometry(const FrameCanvas &frame);
+  FrameResult ReadFrame(FrameCanvas *frame, uint32_t *hold_time_us);
+  FrameResult ReadCompressedFrame(FrameCanvas *frame, uint32_t *hold_time_us);
+  bool VerifyChecksum(const void *header, const char *data);
+  void SetRGBFrame(FrameCanvas *frame, const char *pixels);
+  bool ReadBytes(void *buf, size_t count);
+  bool SkipBytes(size_t count);
+  bool EnsureIndex();
+  bool ReadTrailingIndex();
+  bool ScanIndex();
 
   StreamIO *io_;
   size_t frame_buf_size_;
   State state_;
+  bool is_compressed_;
+  bool is_rgb_;
+  bool zero_copy_;
+  int checksum_interval_;   // -1: not set, use default_checksum_interval_
+  int default_checksum_interval_;
+  int frames_to_next_check_;
+  int corrupt_frames_;
+  int width_;
+  int height_;
+  uint64_t position_;  // Current read position in stream.
+
+  bool index_loaded_;
+  std::vector<StreamFrameInfo> index_;
 
   char *header_frame_buffer_;
+
+  // For compressed streams: the previously decoded frame.
+  std::vector<uint32_t> reference_;
+  bool have_reference_;
+};
+
+// A sequence of streams played one after another, each repeated a number of
+// times and/or for a maximum time. Reads like a single stream; given to a
+// PrefetchingStreamReader, the next item is opened and decoded while the
+// current one is still shown, so there is no gap between items.
+class StreamPlaylist {
+public:
+  struct Item {
+    explicit Item(StreamIO *s)
+      : stream(s), loops(-1), max_duration_us(-1), hold_time_us(-1) {}
+    StreamIO *stream;         // Not owned.
+    int loops;                // Times to play the stream; -1: no limit.
+    int64_t max_duration_us;  // Stream time to play the item; -1: no limit.
+    int64_t hold_time_us;     // Override frame hold times if >= 0.
+  };
+
+  // If "loop" is set, playback continues with the first item after the last.
+  explicit StreamPlaylist(bool loop);
+  ~StreamPlaylist();
+
+  void Add(const Item &item);
+
+  // See StreamReader::SetZeroCopy(); applies to all items.
+  void SetZeroCopy(bool enable);
+
+  // Get the next frame and its hold time; "item" (if not NULL) is set to
+  // the index of the item it belongs to. Returns 'false' at the end of the
+  // playlist or if none of the items provides any frames. Items that can't
+  // be read are skipped.
+  bool GetNext(FrameCanvas *frame, uint32_t *hold_time_us, int *item);
+
+  // Start again with the first item.
+  void Rewind();
+
+  // Frames skipped in all items because they were corrupted; see
+  // StreamReader::corrupt_frames().
+  int corrupt_frames() const;
+
+private:
+  friend class PrefetchingStreamReader;
+
+  // See StreamReader::SetDefaultChecksumInterval(); applies to all items.
+  void SetDefaultChecksumInterval(int interval);
+
+  void StartItem(int index);
+
+  const bool loop_;
+  bool zero_copy_;
+  int default_checksum_interval_;
+  std::vector<Item> items_;
+  std::vector<StreamReader*> readers_;  // Created on first use.
+
+  int current_;             // Item playing; items_.size(): end of playlist.
+  int loops_done_;          // ... of the current item.
+  int frames_in_loop_;      // Frames since last rewind of the current item.
+  int64_t elapsed_us_;      // Stream time spent in the current item.
+};
+
+// Reads frames from a StreamReader ahead of time in a background thread, so
+// that hiccups of the storage don't stall the display.
+//
+// Frames are decoded into a pool of FrameCanvases and handed out to the
+// caller without copying; the caller gives canvases back with Release()
+// once they are not needed anymore, typically the one SwapOnVSync() returns:
+//
+//   FrameCanvas *frame;
+//   while (prefetcher.GetNext(&frame, &hold_time_us)) {
+//     prefetcher.Release(matrix->SwapOnVSync(frame));
+//     ...
+//   }
+class PrefetchingStreamReader {
+public:
+  // Read from "reader", which is not owned and must not be used otherwise
+  // while this object exists. The "canvases" are the pool to decode into;
+  // they need to be created by the same RGBMatrix and must not be
+  // displayed right now. The more there are, the longer the stalls that
+  // can be bridged.
+  //
+  // If "loop" is set, the stream is rewound at its end and reading
+  // continues seamlessly; GetNext() returns 'false' once at every end of the
+  // stream.
+  PrefetchingStreamReader(StreamReader *reader,
+                          const std::vector<FrameCanvas*> &canvases,
+                          bool loop);
+
+  // Read from "playlist" instead, which is not owned and does its own
+  // looping; GetNext() only returns 'false' at its very end.
+  PrefetchingStreamReader(StreamPlaylist *playlist,
+                          const std::vector<FrameCanvas*> &canvases);
+  ~PrefetchingStreamReader();
+
+  // Get the next frame and its hold time, waiting for it if it is not
+  // decoded yet. The frame is on loan until given back with Release().
+  // Returns 'false' at the end of the stream or on errors.
+  // When reading a playlist, "item" (if not NULL) is set to the index of
+  // the playlist item the frame belongs to.
+  bool GetNext(FrameCanvas **frame, uint32_t *hold_time_us, int *item = NULL);
+
+  // Give a canvas back to the pool to decode into. Can be any canvas of
+  // the same RGBMatrix that is not displayed anymore.
+  void Release(FrameCanvas *canvas);
+
+  // Stop reading and hand out all canvases in the pool (including decoded
+  // frames not yet consumed) into "canvases", if not NULL.
+  // The StreamReader or StreamPlaylist is left at an arbitrary position.
+  void Stop(std::vector<FrameCanvas*> *canvases);
+
+  // Number of decoded frames waiting to be picked up by GetNext().
+  int ready_frames();
+
+  // Number of times GetNext() had to wait, because the frame was not
+  // decoded yet (not counting the very first frame).
+  int underruns();
+
+  // Number of frames the reader skipped because they were corrupted
+  // (see StreamReader::SetChecksumInterval()).
+  int corrupt_frames();
+
+private:
+  class ReaderThread;
+  struct ReadyFrame {
+    FrameCanvas *canvas;  // NULL: end of stream.
+    uint32_t hold_time_us;
+    int item;
+  };
+
+  void ReadLoop();
+
+  StreamReader *const reader_;
+  StreamPlaylist *const playlist_;
+  const bool loop_;
+  ReaderThread *thread_;
+
+  Mutex mutex_;
+  pthread_cond_t changed_;
+  std::vector<FrameCanvas*> free_;
+  std::deque<ReadyFrame> ready_;
+  bool running_;
+  bool finished_;     // Thread won't produce any more frames.
+  bool delivered_;    // At least one frame was handed out.
+  int underruns_;
+  int corrupt_frames_;
 };
 }
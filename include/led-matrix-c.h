@@ -39,6 +39,11 @@ struct RGBLedMatrix;
 struct LedCanvas;
 struct LedFont;
 
+/* Values for RGBLedMatrixOptions.refresh_cpu and .refresh_priority that
+ * would be zero in the C++ options, where zero is a valid choice. */
+#define LED_REFRESH_CPU_0         -2
+#define LED_REFRESH_NOT_REALTIME  -1
+
 /**
  * Parameters to create a new matrix.
  *
@@ -158,6 +163,39 @@ struct RGBLedMatrixOptions {
    * processes when waiting and renders single core boards more responsive.
    */
   bool disable_busy_waiting;     /* Corresponding flag: --led-busy-waiting */
+
+  /* Apply brightness by shortening the on-time of all bitplanes, so that
+   * brightness changes take effect immediately without re-rendering.
+   */
+  bool hardware_brightness;      /* Corresponding flag: --led-hardware-brightness */
+
+  /* Limit the power drawn by the LEDs to this percentage of all LEDs showing
+   * full white. 0 = no limit.
+   */
+  int limit_power_percent;       /* Corresponding flag: --led-limit-power */
+
+  /* CPU core the refresh thread is bound to; -1 for no binding. Realtime
+   * priority of that thread and if it should use SCHED_RR instead of
+   * SCHED_FIFO.
+   * As zero keeps the default (core 3, priority 99), use LED_REFRESH_CPU_0
+   * to bind to core 0 and LED_REFRESH_NOT_REALTIME to run the thread
+   * without realtime priority. These are also what is filled in then.
+   */
+  int refresh_cpu;               /* Corresponding flag: --led-refresh-cpu */
+  int refresh_priority;          /* Corresponding flag: --led-refresh-priority */
+  bool refresh_round_robin;      /* Corresponding flag: --led-refresh-round-robin */
+
+  /* Lock all process memory with mlockall() before starting to refresh. */
+  bool lock_memory;              /* Corresponding flag: --led-lock-memory */
+
+  /* Print diagnostics such as startup timing to stderr. */
+  bool verbose;                  /* Corresponding flag: --led-verbose */
+
+  /* File with color corrections for individual panels. */
+  const char *panel_calibration; /* Corresponding flag: --led-panel-calibration */
+
+  /* Dithering of colors with low pwm_bits: "none", "bayer" or "blue-noise" */
+  const char *dither;            /* Corresponding flag: --led-dither */
 };
 
 /**
@@ -341,6 +379,15 @@ void led_canvas_fill(struct LedCanvas *canvas, uint8_t r, uint8_t g, uint8_t b);
  */
 struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix);
 
+/**
+ * Declare the rectangle at (x, y) with size (width, height) as changed since
+ * the canvas was returned by led_matrix_swap_on_vsync(). Once used, the
+ * canvas returned by the swap is brought up to date by copying only the
+ * changed rows. See FrameCanvas::AddDamage() in led-matrix.h.
+ */
+void led_canvas_add_damage(struct LedCanvas *canvas, int x, int y,
+                           int width, int height);
+
 /**
  * Swap the given canvas (created with create_offscreen_canvas) with the
  * currently active canvas on vsync (blocks until vsync is reached).
@@ -34,6 +34,7 @@
 namespace rgb_matrix {
 class RGBMatrix;
 class FrameCanvas;   // Canvas for Double- and Multibuffering
+class StreamReader;
 struct RuntimeOptions;
 
 // The RGB matrix provides the framebuffer and the facilities to constantly
@@ -159,6 +160,80 @@ public:
     // Sleep instead of busy wait to free CPU cycles but get slightly less
     // accurate frame timing.
     bool disable_busy_waiting;   // Flag: --led-busy-waiting
+
+    // Apply brightness by shortening the on-time of all bitplanes instead of
+    // scaling colors while setting pixels. Brightness changes then take
+    // effect immediately for everything displayed, without re-rendering.
+    bool hardware_brightness;    // Flag: --led-hardware-brightness
+
+    // Limit the power drawn by the LEDs to this percentage of all LEDs
+    // showing full white. The load of each frame is estimated when it is
+    // swapped in; frames above the limit are shown dimmed.
+    // 0 = no limit (default).
+    int limit_power_percent;     // Flag: --led-limit-power
+
+    // CPU core the refresh thread is bound to; -1 to leave it to the
+    // scheduler. Ignored if the core does not exist, e.g. on single-core
+    // boards. Default: 3, the last core on a Pi with four cores.
+    int refresh_cpu;             // Flag: --led-refresh-cpu
+
+    // Realtime priority of the refresh thread, 1..99. 0 runs it as regular
+    // non-realtime thread. Default: 99
+    int refresh_priority;        // Flag: --led-refresh-priority
+
+    // Use SCHED_RR instead of SCHED_FIFO realtime scheduling for the
+    // refresh thread.
+    bool refresh_round_robin;    // Flag: --led-refresh-round-robin
+
+    // Lock all memory of the process with mlockall() before starting the
+    // refresh thread, so that it never sees page faults on framebuffers.
+    bool lock_memory;            // Flag: --led-lock-memory
+
+    // Print diagnostics to stderr, such as how long setting up the
+    // framebuffer and pixel mapping took on startup.
+    bool verbose;                // Flag: --led-verbose
+
+    // File with color corrections for individual panels, e.g. to match
+    // panels of different batches. See README for the format. NULL or
+    // empty for none.
+    const char *panel_calibration;  // Flag: --led-panel-calibration
+
+    // Spatial dithering of the color bits that are not shown with fewer
+    // pwm_bits: "none", "bayer" (ordered) or "blue-noise". The pattern
+    // moves with each SwapOnVSync(), so it averages out over time as well.
+    // NULL or empty for none.
+    const char *dither;          // Flag: --led-dither
+  };
+
+  // Statistics of the refresh thread. See GetRefreshStats().
+  struct RefreshStats {
+    // Number of full refreshes of the display so far.
+    uint32_t refresh_count;
+
+    // Estimated LED load of the displayed frame relative to all LEDs showing
+    // full white (0.0 .. 1.0). Only estimated if limit_power_percent is set.
+    float estimated_power;
+
+    // Factor the on-time is currently reduced by to stay within
+    // limit_power_percent. 1.0 means: not limited.
+    float power_limit_scale;
+
+    // Page faults and involuntary context switches of the refresh thread
+    // since it was started. Ideally, these stay at zero.
+    uint32_t minor_page_faults;
+    uint32_t major_page_faults;
+    uint32_t involuntary_context_switches;
+
+    // Number of input events dropped, because ReadInputEvents() was not
+    // called often enough to keep up.
+    uint32_t dropped_input_events;
+  };
+
+  // A change of a GPIO input pin. See ReadInputEvents().
+  struct InputEvent {
+    uint64_t timestamp_us;  // CLOCK_MONOTONIC time the change was seen.
+    int gpio;               // GPIO number of the pin that changed.
+    bool value;             // New level of the pin.
   };
 
   // Factory to create a matrix. Additional functionality includes dropping
@@ -244,8 +319,27 @@ public:
   // scheme implemented by the PixelMapper. Does _not_ take ownership of the
   // mapper. Mapper can be NULL, in which case nothing happens.
   // Returns a boolean indicating if this was successful.
+  //
+  // All canvases switch to the new mapping right away, so only call this
+  // while no other thread is drawing.
   bool ApplyPixelMapper(const PixelMapper *mapper);
 
+  // Replace the pixel mappers while the matrix is running, e.g. to switch
+  // between portrait and landscape. "pixel_mapper_config" is given in the
+  // same format as --led-pixel-mapper (e.g. "Rotate:90"; NULL or empty for
+  // none) and replaces all pixel mappers applied so far.
+  //
+  // The new mapping is built in the calling thread while other threads
+  // keep drawing, then it is switched to at once. A FrameCanvas picks it
+  // up when it is returned by SwapOnVSync(), so a frame is never drawn
+  // with two different mappings; check its width() and height() then, as
+  // they might have changed. The matrix itself (if you draw directly on it
+  // without SwapOnVSync()) switches at the start of its next SetPixel(),
+  // Fill(), Clear(), width() or height() call.
+  //
+  // Returns 'false' if not all mappers could be applied.
+  bool RemapPixels(const char *pixel_mapper_config);
+
   // Note, there used to be ApplyStaticTransformer(), which has been deprecated
   // since 2018 and changed to a compile-time option, then finally removed
   // in 2020. Use PixelMapper instead, which is simpler and more intuitive.
@@ -266,7 +360,9 @@ public:
   bool luminance_correct() const;
 
   // Set brightness in percent for all created FrameCanvas. 1%..100%.
-  // This will only affect newly set pixels.
+  // This will only affect newly set pixels, unless the matrix was created
+  // with Options::hardware_brightness, in which case it applies to the
+  // displayed content right away.
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
@@ -302,6 +398,28 @@ public:
   // Returns the bitmap of all GPIO input pins.
   uint64_t AwaitInputChange(int timeout_ms);
 
+  // Set the debounce time for the given bitmap of input pins. A change of
+  // one of these pins is only reported once the pin has been quiet (kept
+  // its new level) for "debounce_us" microseconds; the event timestamp is
+  // when it changed to that level. Default is 0, i.e. report every change.
+  // Can be set before the refresh thread is started.
+  void SetInputDebounce(uint64_t gpio_bits, int debounce_us);
+
+  // Read up to "max_events" of the input changes recorded by the refresh
+  // thread into "events", oldest first. Unlike AwaitInputChange(), this
+  // does not miss changes that happen between calls, as long as they are
+  // read before the internal queue of 256 events fills up (see
+  // RefreshStats::dropped_input_events).
+  //
+  // Waits up to "timeout_ms" milliseconds for events if there are none yet
+  // (a negative value waits forever, 0 does not wait).
+  // Returns the number of events stored in "events".
+  //
+  // Inputs are sampled once per refresh, so changes faster than the
+  // refresh-rate still can't be seen. Pins that are already high when they
+  // are first sampled report that level as their first event.
+  int ReadInputEvents(InputEvent *events, int max_events, int timeout_ms);
+
   // Request user writable GPIO bits.
   // This allows to request a bitmap of GPIO-bits to be used by the user for
   // writing.
@@ -321,6 +439,10 @@ public:
   RGBMatrix *gpio() __attribute__((deprecated)) { return this; }
 
   //--  Rarely needed
+  // Get a snapshot of the statistics gathered by the refresh thread.
+  // Returns 'false' if the refresh thread is not running.
+  bool GetRefreshStats(RefreshStats *stats);
+
   // Start the refresh thread.
   // This is only needed if you chose RuntimeOptions::daemon = -1 (see below),
   // otherwise the refresh thread is already started.
@@ -377,6 +499,18 @@ public:
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
+  // Declare the area that changed since this canvas was returned by
+  // SwapOnVSync(). Once a canvas declares damage, SwapOnVSync() brings the
+  // canvas it returns up to date with it by copying only the damaged rows,
+  // so unchanged content neither needs to be redrawn nor copied with
+  // CopyFrom(). Clear(), Fill(), CopyFrom() and Deserialize() damage the
+  // whole canvas.
+  // This is meant for double-buffering: if the canvas swapped in is not
+  // the one the previous SwapOnVSync() returned, everything is copied.
+  // After RGBMatrix::RemapPixels(), the content of the canvas is laid out
+  // for the old mapping; redraw all of it, the next swap copies everything.
+  void AddDamage(int x, int y, int width, int height);
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -389,6 +523,7 @@ public:
 
 private:
   friend class RGBMatrix;
+  friend class StreamReader;
 
   FrameCanvas(internal::Framebuffer *frame) : frame_(frame){}
   virtual ~FrameCanvas();   // Any FrameCanvas is owned by RGBMatrix.
@@ -76,7 +76,8 @@ public:
   // So for many multiplexing methods this means to map a panel to a double
   // length and half height panel (32x16 -> 64x8).
   // The logic_x, logic_y are output parameters and guaranteed not to be
-  // nullptr.
+  // nullptr. Setting both to -1 marks a gap in the arrangement: the visible
+  // pixel is not shown anywhere.
   virtual void MapVisibleToMatrix(int matrix_width, int matrix_height,
                                   int visible_x, int visible_y,
                                   int *matrix_x, int *matrix_y) const = 0;
@@ -0,0 +1,121 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// A ring of RGB frames in POSIX shared memory, so that other processes can
+// provide content to a display server that owns the RGBMatrix (see
+// utils/led-display-server.cc) without linking the library or needing
+// access to the GPIO.
+//
+// Producers write packed RGB pixels into the next slot of the ring and
+// publish it; the display server picks up the newest complete frame and
+// converts it directly from shared memory into a FrameCanvas.
+//
+// Layout of the shared memory, all integers little-endian, so that
+// producers in other languages can write it, e.g. via mmap():
+//
+//   Header (64 bytes), at offset 0:
+//     uint32_t magic;          0x474E5252 ("RRNG")
+//     uint32_t version;        1
+//     uint32_t width;
+//     uint32_t height;
+//     uint32_t slot_count;
+//     uint32_t slot_stride;    Bytes from one slot to the next.
+//     uint64_t next_sequence;  Next sequence number to be claimed.
+//     uint64_t published;      1 + sequence number of the newest frame.
+//     (reserved up to 64 bytes)
+//   Slots, at offset 64 + n * slot_stride:
+//     uint64_t state;          2 * sequence + 1 while writing,
+//                              2 * sequence + 2 when complete.
+//     (reserved up to 64 bytes)
+//     width * height * 3 bytes of RGB pixels, row by row.
+//
+// To write a frame, a producer claims sequence number "s" by atomically
+// incrementing next_sequence, sets the state of slot s % slot_count to
+// 2s+1, writes the pixels, sets the state to 2s+2 and raises published to
+// s+1 unless it is already larger. With a single producer, plain stores
+// with a memory barrier before each state/published update are enough.
+#ifndef RPI_RGBMATRIX_SHM_FRAME_RING_H
+#define RPI_RGBMATRIX_SHM_FRAME_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace rgb_matrix {
+class FrameCanvas;
+struct Color;
+
+class ShmFrameRing {
+public:
+  // Create the shared memory ring "name" (e.g. "/rgbmatrix") for frames of
+  // "width" x "height" pixels, replacing an existing one. This is done by
+  // the display server; the ring is removed again when the returned object
+  // is deleted. Returns NULL on failure.
+  static ShmFrameRing *Create(const char *name, int width, int height,
+                              int slot_count);
+
+  // Attach to the existing ring "name" as producer. Returns NULL on failure,
+  // e.g. if the server is not running.
+  static ShmFrameRing *Attach(const char *name);
+
+  ~ShmFrameRing();
+
+  int width() const;
+  int height() const;
+
+  // -- Producer
+
+  // Claim the next slot and return its pixels to be filled with
+  // width() * height() colors, row by row. Each BeginFrame() needs to be
+  // followed by PublishFrame() before the next one.
+  Color *BeginFrame();
+
+  // Make the frame started with BeginFrame() the newest frame.
+  void PublishFrame();
+
+  // -- Display server
+
+  // If a frame was published after the one identified by "*sequence"
+  // (start with 0), convert the newest one into "canvas" and update
+  // "*sequence". Returns 'false' if there is no new frame or if it was
+  // overwritten by a producer while converting (the content of "canvas" is
+  // undefined then, but a newer frame is available).
+  bool GetNewest(FrameCanvas *canvas, uint64_t *sequence);
+
+private:
+  ShmFrameRing(const std::string &name, bool owner, char *memory,
+               size_t size, int width, int height, int slot_count,
+               size_t slot_stride);
+  char *SlotFor(uint64_t sequence) const;
+
+  const std::string name_;
+  const bool owner_;
+  char *const memory_;
+  const size_t size_;
+
+  // Geometry, never re-read from the shared memory which any local
+  // process can write to.
+  const int width_;
+  const int height_;
+  const int slot_count_;
+  const size_t slot_stride_;
+
+  char *writing_slot_;       // Producer: slot between Begin/PublishFrame()
+  uint64_t writing_sequence_;
+};
+
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_SHM_FRAME_RING_H
@@ -32,7 +32,7 @@ public:
   void WaitStopped();
 
   // Start thread. If realtime_priority is > 0, then this will be a
-  // thread with SCHED_FIFO and the given priority.
+  // realtime thread (SCHED_FIFO by default) with the given priority.
   // If cpu_affinity is set !=, chooses the given bitmask of CPUs
   // this thread should have an affinity to.
   // On a Raspberry Pi 1, this doesn't matter, as there is only one core,
@@ -40,6 +40,10 @@ public:
   // valid.
   virtual void Start(int realtime_priority = 0, uint32_t cpu_affinity_mask = 0);
 
+  // Realtime scheduling policy used by Start() if a realtime_priority is
+  // given. SCHED_FIFO (the default) or SCHED_RR. Call before Start().
+  void set_realtime_policy(int policy) { realtime_policy_ = policy; }
+
   // Override this to do the work.
   //
   // This will be called in a thread once Start() has been called. You typically
@@ -52,6 +56,7 @@ public:
 private:
   static void *PthreadCallRun(void *tobject);
   bool started_;
+  int realtime_policy_;
   pthread_t thread_;
 };
 
@@ -1,19 +1,30 @@
 // -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
 
 #include "content-streamer.h"
+#include "graphics.h"
 #include "led-matrix.h"
 
+#include <assert.h>
 #include <cstddef>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 
 #include <algorithm>
 
+#if defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#elif defined(__SSE4_2__)
+#  include <nmmintrin.h>
+#endif
+
+#include "framebuffer-internal.h"
 #include "gpio-bits.h"
 
 namespace rgb_matrix {
@@ -34,20 +45,241 @@ struct FileHeader {
   uint32_t height;
   uint64_t future_use1;
   uint64_t is_wide_gpio : 1;
-  uint64_t flags_future_use : 63;
+  uint64_t is_delta_compressed : 1;  // Frames are compressed (see below)
+  uint64_t is_rgb : 1;    // Packed RGB pixels, padded to 32 bit.
+  uint64_t flags_future_use : 61;
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FileHeader) == 32);
+STATIC_ASSERT(color_is_packed_rgb, sizeof(Color) == 3);
 
 static const uint32_t kFrameMagicValue = 0x12345678;
 struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
-  uint64_t future_use2;
+  uint32_t flags;         // kFrameFlag*
+  uint32_t padding;       // Bytes between this header and the frame data.
+  uint32_t checksum;      // See FrameChecksum(); if kFrameFlagChecksum.
   uint64_t future_use3;
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FrameHeader) == 32);
+
+// Compressed frame that does not depend on the previous one.
+static const uint32_t kFrameFlagKeyframe = 1 << 0;
+// The checksum field is set (not in streams of older versions).
+static const uint32_t kFrameFlagChecksum = 1 << 1;
+
+// Optional index at the end of the stream, written by StreamWriter::Finalize():
+//   IndexHeader, StreamFrameInfo * frame_count, IndexFooter
+// The IndexHeader is the same size as a FrameHeader, so readers that just
+// go through the frames stop at its magic value.
+static const uint32_t kIndexMagicValue = 0x1DE8F0A7;
+struct IndexHeader {
+  uint32_t magic;  // kIndexMagicValue
+  uint32_t frame_count;
+  uint64_t total_time_us;
+  uint64_t future_use1;
+  uint64_t future_use2;
+};
+STATIC_ASSERT(index_header_size_changed,
+              sizeof(IndexHeader) == sizeof(FrameHeader));
+STATIC_ASSERT(index_entry_size_changed, sizeof(StreamFrameInfo) == 24);
+
+// At the very end of the stream to find the index.
+struct IndexFooter {
+  uint64_t index_offset;   // Position of IndexHeader.
+  uint32_t frame_count;
+  uint32_t magic;          // kIndexMagicValue
+};
+STATIC_ASSERT(index_footer_size_changed, sizeof(IndexFooter) == 16);
+
+// CRC32C (Castagnoli), continuing from "crc" (0 to start). Uses the CRC
+// instructions of the CPU if the compiler targets them, e.g. the Raspberry
+// Pi 3 and newer with -march=native; otherwise a table lookup per 4 bytes.
+#if defined(__ARM_FEATURE_CRC32) || defined(__SSE4_2__)
+#  if defined(__ARM_FEATURE_CRC32)
+#    define CRC32C_BYTE(crc, b) __crc32cb(crc, b)
+#    define CRC32C_WORD(crc, w) __crc32cw(crc, w)
+#  else
+#    define CRC32C_BYTE(crc, b) _mm_crc32_u8(crc, b)
+#    define CRC32C_WORD(crc, w) _mm_crc32_u32(crc, w)
+#  endif
+static uint32_t Crc32c(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t*) data;
+  crc = ~crc;
+  for (; len > 0 && ((uintptr_t)p & 3); --len) crc = CRC32C_BYTE(crc, *p++);
+  for (; len >= 4; len -= 4, p += 4) {
+    crc = CRC32C_WORD(crc, *(const uint32_t*)p);
+  }
+  for (; len > 0; --len) crc = CRC32C_BYTE(crc, *p++);
+  return ~crc;
+}
+#  undef CRC32C_BYTE
+#  undef CRC32C_WORD
+#else
+struct Crc32cTable {
+  Crc32cTable() {
+    for (int i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int bit = 0; bit < 8; ++bit) c = (c >> 1) ^ (0x82F63B78 & -(c & 1));
+      t[0][i] = c;
+    }
+    for (int i = 0; i < 256; ++i) {
+      for (int s = 1; s < 4; ++s)
+        t[s][i] = (t[s-1][i] >> 8) ^ t[0][t[s-1][i] & 0xff];
+    }
+  }
+  uint32_t t[4][256];
+};
+
+static uint32_t Crc32c(uint32_t crc, const void *data, size_t len) {
+  static const Crc32cTable table;
+  const uint32_t (*const t)[256] = table.t;
+  const uint8_t *p = (const uint8_t*) data;
+  crc = ~crc;
+  for (; len > 0 && ((uintptr_t)p & 3); --len)
+    crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  for (; len >= 4; len -= 4, p += 4) {
+    crc ^= *(const uint32_t*)p;  // Streams are little-endian anyway.
+    crc = (t[3][crc & 0xff] ^ t[2][(crc >> 8) & 0xff]
+           ^ t[1][(crc >> 16) & 0xff] ^ t[0][crc >> 24]);
+  }
+  for (; len > 0; --len)
+    crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+#endif
+
+// Checksum of a frame: its header (with the checksum field being zero)
+// followed by the frame data as stored, i.e. compressed if the stream is.
+static uint32_t FrameChecksum(const FrameHeader &h, const void *data,
+                              size_t len) {
+  FrameHeader header = h;
+  header.checksum = 0;
+  return Crc32c(Crc32c(0, &header, sizeof(header)), data, len);
+}
+
+// In delta-compressed streams, the frame data is the XOR of the 32-bit words
+// of the frame with the previous frame (or with all zero for keyframes),
+// encoded as sequence of runs:
+//   <varint zero-words> <varint literal-words> <literal-words * 4 bytes>
+// Varints are unsigned LEB128.
+//
+// Upper bound of encoded size: all runs but the first and last start with
+// at least two zero-words, each run header is at most two 5-byte varints.
+static size_t MaxEncodedSize(size_t words) {
+  return words * sizeof(uint32_t) + (words / 2 + 2) * 2 * 5;
+}
+
+static char *PutVarint(char *out, uint32_t value) {
+  while (value >= 0x80) {
+    *out++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+  return out;
+}
+
+// Returns pointer after varint or NULL if it runs past "end".
+static const char *GetVarint(const char *in, const char *end,
+                             uint32_t *value) {
+  *value = 0;
+  for (int shift = 0; in < end && shift < 35; shift += 7) {
+    const uint8_t b = *in++;
+    *value |= (uint32_t)(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return in;
+  }
+  return NULL;
+}
+
+static inline uint32_t WordAt(const char *data, size_t i) {
+  uint32_t result;
+  memcpy(&result, data + i * sizeof(uint32_t), sizeof(result));
+  return result;
+}
+
+// Encode "words" of "data" relative to "reference" (NULL: keyframe) into
+// "out", which needs to have space for MaxEncodedSize().
+// Returns the encoded size.
+static size_t EncodeDelta(const char *data, const uint32_t *reference,
+                          size_t words, char *out) {
+  char *const out_start = out;
+  size_t i = 0;
+  while (i < words) {
+    const size_t zero_start = i;
+    while (i < words && WordAt(data, i) == (reference ? reference[i] : 0))
+      ++i;
+    const size_t literal_start = i;
+    while (i < words) {
+      // Single unchanged words are cheaper as literal than as new run.
+      const bool same = WordAt(data, i) == (reference ? reference[i] : 0);
+      const bool next_same = (i + 1 == words
+                              || WordAt(data, i + 1) == (reference
+                                                         ? reference[i + 1]
+                                                         : 0));
+      if (same && next_same) break;
+      ++i;
+    }
+    out = PutVarint(out, literal_start - zero_start);
+    out = PutVarint(out, i - literal_start);
+    for (size_t w = literal_start; w < i; ++w) {
+      const uint32_t delta = WordAt(data, w) ^ (reference ? reference[w] : 0);
+      memcpy(out, &delta, sizeof(delta));
+      out += sizeof(delta);
+    }
+  }
+  return out - out_start;
+}
+
+// Decode "len" bytes encoded with EncodeDelta() into "out" with "words"
+// 32-bit words. "reference" is the previous frame and is updated to the
+// decoded frame. Keyframes don't use the previous content of "reference".
+// "out" can be NULL to only update the reference (used when seeking).
+// Returns 'false' if the data is inconsistent.
+static bool DecodeDelta(const char *in, size_t len, bool is_keyframe,
+                        uint32_t *reference, char *out, size_t words) {
+  const char *const end = in + len;
+  size_t i = 0;
+  while (i < words) {
+    uint32_t zeros, literals;
+    if ((in = GetVarint(in, end, &zeros)) == NULL
+        || (in = GetVarint(in, end, &literals)) == NULL) {
+      return false;
+    }
+    if (zeros + (size_t)literals == 0
+        || zeros > words - i || literals > words - i - zeros
+        || (size_t)(end - in) < literals * sizeof(uint32_t)) {
+      return false;
+    }
+    if (is_keyframe) {
+      memset(reference + i, 0, zeros * sizeof(uint32_t));
+    }
+    if (out) {
+      memcpy(out + i * sizeof(uint32_t), reference + i,
+             zeros * sizeof(uint32_t));
+    }
+    i += zeros;
+    for (uint32_t n = 0; n < literals; ++n, ++i, in += sizeof(uint32_t)) {
+      uint32_t word;
+      memcpy(&word, in, sizeof(word));
+      if (!is_keyframe) word ^= reference[i];
+      reference[i] = word;
+      if (out) memcpy(out + i * sizeof(uint32_t), &word, sizeof(word));
+    }
+  }
+  return in == end;
+}
+}
+
+ssize_t StreamIO::AppendVector(const struct iovec *iov, int count) {
+  ssize_t total = 0;
+  for (int i = 0; i < count; ++i) {
+    const ssize_t w = Append(iov[i].iov_base, iov[i].iov_len);
+    if (w < 0) return total ? total : w;
+    total += w;
+    if ((size_t)w < iov[i].iov_len) break;
+  }
+  return total;
 }
 
 FileStreamIO::FileStreamIO(int fd) : fd_(fd) {
@@ -65,17 +297,103 @@ ssize_t FileStreamIO::Append(const void *buf, const size_t count) {
   return write(fd_, buf, count);
 }
 
+ssize_t FileStreamIO::AppendVector(const struct iovec *iov, int count) {
+  return writev(fd_, iov, std::min(count, IOV_MAX));
+}
+
+bool FileStreamIO::Preallocate(off_t size) {
+  // Keep the size, so that readers still find the end of the stream.
+  return fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+}
+
+bool FileStreamIO::Seek(off_t pos) {
+  return lseek(fd_, pos, SEEK_SET) == pos;
+}
+
+off_t FileStreamIO::Size() {
+  struct stat s;
+  if (fstat(fd_, &s) < 0) return -1;
+  return s.st_size;
+}
+
+constexpr size_t MemStreamIO::kMinChunkSize;
+constexpr size_t MemStreamIO::kMaxChunkSize;
+
+MemStreamIO::MemStreamIO() : size_(0), capacity_(0), pos_(0) {}
+MemStreamIO::~MemStreamIO() {
+  for (size_t i = 0; i < chunks_.size(); ++i) delete [] chunks_[i].data;
+}
+
+// New chunks are about as large as everything so far, so that there are
+// only few chunks, but not much unused memory.
+void MemStreamIO::AddChunk(size_t min_size) {
+  Chunk chunk;
+  chunk.size = std::max(std::min(std::max(capacity_, kMinChunkSize),
+                                 kMaxChunkSize),
+                        min_size);
+  chunk.data = new char[chunk.size];
+  chunk.start = capacity_;
+  chunks_.push_back(chunk);
+  capacity_ += chunk.size;
+}
+
+// Index of the chunk containing stream position "pos". Needs chunks.
+size_t MemStreamIO::ChunkFor(size_t pos) const {
+  size_t lo = 0, hi = chunks_.size();
+  while (hi - lo > 1) {
+    const size_t mid = (lo + hi) / 2;
+    if (chunks_[mid].start <= pos) lo = mid; else hi = mid;
+  }
+  return lo;
+}
+
 void MemStreamIO::Rewind() { pos_ = 0; }
 ssize_t MemStreamIO::Read(void *buf, size_t count) {
-  const size_t amount = std::min(count, buffer_.size() - pos_);
-  memcpy(buf, buffer_.data() + pos_, amount);
-  pos_ += amount;
-  return amount;
+  count = std::min(count, size_ - pos_);
+  if (count == 0) return 0;
+  char *out = (char*)buf;
+  size_t remaining = count;
+  for (size_t c = ChunkFor(pos_); remaining > 0; ++c) {
+    const Chunk &chunk = chunks_[c];
+    const size_t offset = pos_ - chunk.start;
+    const size_t amount = std::min(remaining, chunk.size - offset);
+    memcpy(out, chunk.data + offset, amount);
+    out += amount; pos_ += amount; remaining -= amount;
+  }
+  return count;
 }
 ssize_t MemStreamIO::Append(const void *buf, size_t count) {
-  buffer_.append((const char*)buf, count);
+  if (count == 0) return 0;
+  if (size_ + count > capacity_) AddChunk(size_ + count - capacity_);
+  const char *in = (const char*)buf;
+  size_t remaining = count;
+  for (size_t c = ChunkFor(size_); remaining > 0; ++c) {
+    const Chunk &chunk = chunks_[c];
+    const size_t offset = size_ - chunk.start;
+    const size_t amount = std::min(remaining, chunk.size - offset);
+    memcpy(chunk.data + offset, in, amount);
+    in += amount; size_ += amount; remaining -= amount;
+  }
   return count;
 }
+const char *MemStreamIO::ReadDirect(size_t count) {
+  if (count == 0 || count > size_ - pos_) return NULL;
+  const Chunk &chunk = chunks_[ChunkFor(pos_)];
+  const size_t offset = pos_ - chunk.start;
+  if (offset + count > chunk.size) return NULL;  // Spans chunks.
+  pos_ += count;
+  return chunk.data + offset;
+}
+bool MemStreamIO::Preallocate(off_t size) {
+  if ((size_t)size > capacity_) AddChunk(size - capacity_);
+  return true;
+}
+bool MemStreamIO::Seek(off_t pos) {
+  if (pos < 0 || (size_t)pos > size_) return false;
+  pos_ = pos;
+  return true;
+}
+off_t MemStreamIO::Size() { return size_; }
 
 MemMapViewInput::MemMapViewInput(int fd) : buffer_(nullptr) {
   struct stat s;
@@ -101,11 +419,23 @@ MemMapViewInput::MemMapViewInput(int fd) : buffer_(nullptr) {
 
 void MemMapViewInput::Rewind() { pos_ = buffer_; }
 ssize_t MemMapViewInput::Read(void *buf, size_t count) {
-  if (pos_ + count >= end_) return -1;
+  count = std::min(count, (size_t)(end_ - pos_));
   memcpy(buf, pos_, count);
   pos_ += count;
   return count;
 }
+const char *MemMapViewInput::ReadDirect(size_t count) {
+  if (count > (size_t)(end_ - pos_)) return NULL;
+  const char *result = pos_;
+  pos_ += count;
+  return result;
+}
+bool MemMapViewInput::Seek(off_t pos) {
+  if (pos < 0 || pos > end_ - buffer_) return false;
+  pos_ = buffer_ + pos;
+  return true;
+}
+off_t MemMapViewInput::Size() { return end_ - buffer_; }
 
 MemMapViewInput::~MemMapViewInput() {
   if (buffer_) munmap(buffer_, end_ - buffer_);
@@ -113,10 +443,10 @@ MemMapViewInput::~MemMapViewInput() {
 
 // Read exactly count bytes including retries. Returns success.
 static bool FullRead(StreamIO *io, void *buf, const size_t count) {
-  int remaining = count;
+  size_t remaining = count;
   char *char_buffer = (char*)buf;
   while (remaining > 0) {
-    int r = io->Read(char_buffer, remaining);
+    const ssize_t r = io->Read(char_buffer, remaining);
     if (r < 0) return false;
     if (r == 0) break;  // EOF.
     char_buffer += r; remaining -= r;
@@ -124,48 +454,235 @@ static bool FullRead(StreamIO *io, void *buf, const size_t count) {
   return remaining == 0;
 }
 
-// Write exactly count bytes including retries. Returns success.
-static bool FullAppend(StreamIO *io, const void *buf, const size_t count) {
-  int remaining = count;
-  const char *char_buffer = (const char*) buf;
-  while (remaining > 0) {
-    int w = io->Append(char_buffer, remaining);
-    if (w < 0) return false;
-    char_buffer += w; remaining -= w;
+// Write all "count" buffers of "iov" including retries. Modifies "iov" to
+// keep track. Returns success.
+static bool FullAppendVector(StreamIO *io, struct iovec *iov, int count) {
+  while (count > 0) {
+    if (iov->iov_len == 0) {
+      ++iov; --count;
+      continue;
+    }
+    const ssize_t w = io->AppendVector(iov, count);
+    if (w <= 0) return false;
+    size_t written = w;
+    while (count > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov; --count;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
   }
-  return remaining == 0;
+  return true;
+}
+
+static struct iovec MakeIovec(const void *data, size_t len) {
+  struct iovec result;
+  result.iov_base = const_cast<void*>(data);
+  result.iov_len = len;
+  return result;
+}
+
+StreamWriter::StreamWriter(StreamIO *io, bool compress)
+  : io_(io), compress_(compress), alignment_(0), header_written_(false),
+    finalized_(false), is_rgb_(false), width_(0), height_(0),
+    frame_size_(0), frame_count_(0), offset_(0), total_time_us_(0),
+    buffer_writes_(false) {
+}
+
+StreamWriter::~StreamWriter() { Flush(); }
+
+void StreamWriter::SetWriteBuffering(bool on) {
+  if (!on) Flush();
+  buffer_writes_ = on;
+  if (on) write_buffer_.reserve(kWriteBufferSize);
+}
+
+// Collect the buffers in the write buffer if they fit, otherwise write
+// them out together with what is buffered.
+bool StreamWriter::Write(const struct iovec *iov, int count) {
+  struct iovec all[4];
+  assert(count < 4);
+  if (!buffer_writes_) {
+    std::copy(iov, iov + count, all);
+    return FullAppendVector(io_, all, count);
+  }
+  size_t total = 0;
+  for (int i = 0; i < count; ++i) total += iov[i].iov_len;
+  if (write_buffer_.size() + total <= kWriteBufferSize) {
+    for (int i = 0; i < count; ++i) {
+      const char *data = (const char*)iov[i].iov_base;
+      write_buffer_.insert(write_buffer_.end(), data, data + iov[i].iov_len);
+    }
+    return true;
+  }
+  all[0] = MakeIovec(write_buffer_.data(), write_buffer_.size());
+  for (int i = 0; i < count; ++i) all[i + 1] = iov[i];
+  const bool success = FullAppendVector(io_, all, count + 1);
+  write_buffer_.clear();
+  return success;
+}
+
+bool StreamWriter::Flush() {
+  if (write_buffer_.empty()) return true;
+  struct iovec iov = MakeIovec(write_buffer_.data(), write_buffer_.size());
+  const bool success = FullAppendVector(io_, &iov, 1);
+  write_buffer_.clear();
+  return success;
+}
+
+bool StreamWriter::Preallocate(const FrameCanvas &frame, int frames) {
+  if (compress_ || is_rgb_ || frames <= 0) return false;
+  const char *data;
+  size_t len;
+  frame.Serialize(&data, &len);
+  const uint64_t frame_bytes = sizeof(FrameHeader) + len
+    + (alignment_ > 1 ? alignment_ - 1 : 0);
+  const uint64_t header_bytes = header_written_ ? 0 : sizeof(FileHeader);
+  return io_->Preallocate(offset_ + header_bytes + frame_bytes * frames);
+}
+
+bool StreamWriter::SetFrameAlignment(uint32_t alignment) {
+  if (header_written_ || alignment > kMaxFrameAlignment
+      || (alignment & (alignment - 1)) != 0) {
+    return false;
+  }
+  alignment_ = alignment;
+  return true;
 }
 
-StreamWriter::StreamWriter(StreamIO *io) : io_(io), header_written_(false) {}
 bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
+  if (finalized_) return false;
   const char *data;
   size_t len;
   frame.Serialize(&data, &len);
 
   if (!header_written_) {
-    WriteFileHeader(frame, len);
+    if (!WriteFileHeader(frame.width(), frame.height(), len, false))
+      return false;
+  } else if (is_rgb_ || len != frame_size_) {
+    return false;  // All frames need to be like the first.
   }
+  return StreamData(data, len, hold_time_us);
+}
+
+bool StreamWriter::StreamRGB(const Color *pixels, int width, int height,
+                             uint32_t hold_time_us) {
+  const size_t pixel_bytes = (size_t)width * height * sizeof(Color);
+  if (finalized_) return false;
+  if (!header_written_) {
+    const size_t words = (pixel_bytes + 3) / sizeof(uint32_t);
+    rgb_buffer_.resize(words * sizeof(uint32_t));
+    if (!WriteFileHeader(width, height, rgb_buffer_.size(), true))
+      return false;
+  } else if (!is_rgb_ || width != width_ || height != height_) {
+    return false;
+  }
+  memcpy(rgb_buffer_.data(), pixels, pixel_bytes);
+  return StreamData(rgb_buffer_.data(), rgb_buffer_.size(), hold_time_us);
+}
+
+bool StreamWriter::StreamData(const char *data, size_t len,
+                              uint32_t hold_time_us) {
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
-  h.size = len;
   h.hold_time_us = hold_time_us;
-  FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  if (!compress_) {
+    h.size = len;
+    if (alignment_ > 1) {
+      const uint64_t data_start = offset_ + sizeof(FrameHeader);
+      h.padding = (alignment_ - data_start % alignment_) % alignment_;
+    }
+    h.flags |= kFrameFlagChecksum;
+    h.checksum = FrameChecksum(h, data, len);
+    return AppendFrame(&h, data, len);
+  }
+
+  const size_t words = len / sizeof(uint32_t);
+  const bool is_keyframe = (frame_count_ % kKeyframeInterval == 0);
+  if (is_keyframe) h.flags |= kFrameFlagKeyframe;
+  h.size = EncodeDelta(data, is_keyframe ? NULL : reference_.data(), words,
+                       encode_buffer_.data());
+  memcpy(reference_.data(), data, words * sizeof(uint32_t));
+  h.flags |= kFrameFlagChecksum;
+  h.checksum = FrameChecksum(h, encode_buffer_.data(), h.size);
+  return AppendFrame(&h, encode_buffer_.data(), h.size);
+}
+
+bool StreamWriter::AppendFrame(const void *header, const void *data,
+                               size_t len) {
+  const FrameHeader &h = *reinterpret_cast<const FrameHeader*>(header);
+  StreamFrameInfo info;
+  info.offset = offset_;
+  info.start_time_us = total_time_us_;
+  info.hold_time_us = h.hold_time_us;
+  info.flags = h.flags;
+  index_.push_back(info);
+  frame_count_++;
+  total_time_us_ += h.hold_time_us;
+  offset_ += sizeof(FrameHeader) + h.padding + len;
+  static const char kZeros[kMaxFrameAlignment] = {};
+  const struct iovec iov[3] = {
+    MakeIovec(header, sizeof(FrameHeader)),
+    MakeIovec(kZeros, h.padding),
+    MakeIovec(data, len),
+  };
+  return Write(iov, 3);
 }
 
-void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
+bool StreamWriter::Finalize() {
+  if (!header_written_ || finalized_) return false;
+  finalized_ = true;
+  IndexHeader header = {};
+  header.magic = kIndexMagicValue;
+  header.frame_count = index_.size();
+  header.total_time_us = total_time_us_;
+  IndexFooter footer = {};
+  footer.index_offset = offset_;
+  footer.frame_count = index_.size();
+  footer.magic = kIndexMagicValue;
+  const struct iovec iov[3] = {
+    MakeIovec(&header, sizeof(header)),
+    MakeIovec(index_.data(), index_.size() * sizeof(StreamFrameInfo)),
+    MakeIovec(&footer, sizeof(footer)),
+  };
+  return Write(iov, 3) && Flush();
+}
+
+bool StreamWriter::WriteFileHeader(int width, int height, size_t len,
+                                   bool is_rgb) {
   FileHeader header = {};
   header.magic = kFileMagicValue;
-  header.width = frame.width();
-  header.height = frame.height();
+  header.width = width;
+  header.height = height;
   header.buf_size = len;
-  header.is_wide_gpio = (sizeof(gpio_bits_t) > 4);
-  FullAppend(io_, &header, sizeof(header));
+  header.is_wide_gpio = !is_rgb && (sizeof(gpio_bits_t) > 4);
+  header.is_delta_compressed = compress_;
+  header.is_rgb = is_rgb;
+  const struct iovec iov = MakeIovec(&header, sizeof(header));
+  if (!Write(&iov, 1)) return false;
+  offset_ += sizeof(header);
   header_written_ = true;
+  is_rgb_ = is_rgb;
+  width_ = width;
+  height_ = height;
+  frame_size_ = len;
+  if (compress_) {
+    reference_.resize(len / sizeof(uint32_t));
+    encode_buffer_.resize(MaxEncodedSize(len / sizeof(uint32_t)));
+  }
+  return true;
 }
 
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), header_frame_buffer_(NULL) {
+  : io_(io), state_(STREAM_AT_BEGIN), is_compressed_(false), is_rgb_(false),
+    zero_copy_(false), checksum_interval_(-1),
+    default_checksum_interval_(kSampledChecksumInterval),
+    frames_to_next_check_(0),
+    corrupt_frames_(0), width_(0), height_(0), position_(0),
+    index_loaded_(false),
+    header_frame_buffer_(NULL), have_reference_(false) {
   io_->Rewind();
 }
 StreamReader::~StreamReader() { delete [] header_frame_buffer_; }
@@ -173,55 +690,187 @@ StreamReader::~StreamReader() { delete [] header_frame_buffer_; }
 void StreamReader::Rewind() {
   io_->Rewind();
   state_ = STREAM_AT_BEGIN;
+  position_ = 0;
+  have_reference_ = false;
+}
+
+bool StreamReader::ReadBytes(void *buf, size_t count) {
+  if (!FullRead(io_, buf, count)) return false;
+  position_ += count;
+  return true;
+}
+
+bool StreamReader::SkipBytes(size_t count) {
+  if (io_->ReadDirect(count)) {
+    position_ += count;
+    return true;
+  }
+  const size_t chunk_size = sizeof(FrameHeader) + frame_buf_size_;
+  while (count > 0) {
+    const size_t chunk = std::min(count, chunk_size);
+    if (!ReadBytes(header_frame_buffer_, chunk)) return false;
+    count -= chunk;
+  }
+  return true;
 }
 
 bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
-  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader(*frame)) return false;
+  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader()) return false;
   if (state_ != STREAM_READING) return false;
+  if (!is_rgb_ && !CheckGeometry(*frame)) return false;
+  FrameResult result;
+  do {
+    result = is_compressed_
+      ? ReadCompressedFrame(frame, hold_time_us)
+      : ReadFrame(frame, hold_time_us);
+  } while (result == FRAME_SKIPPED);
+  return result == FRAME_OK;
+}
 
-  // Read header and expected buffer size.
-  if (!FullRead(io_, header_frame_buffer_,
-                sizeof(FrameHeader) + frame_buf_size_)) {
-    return false;
+bool StreamReader::VerifyChecksum(const void *header, const char *data) {
+  const FrameHeader &h = *reinterpret_cast<const FrameHeader*>(header);
+  const int interval = (checksum_interval_ < 0)
+    ? default_checksum_interval_ : checksum_interval_;
+  if (!(h.flags & kFrameFlagChecksum) || interval <= 0)
+    return true;
+  if (frames_to_next_check_ > 0) {
+    --frames_to_next_check_;
+    return true;
   }
+  frames_to_next_check_ = interval - 1;
+  if (FrameChecksum(h, data, h.size) == h.checksum)
+    return true;
+  ++corrupt_frames_;
+  return false;
+}
 
-  const FrameHeader &h = *reinterpret_cast<FrameHeader*>(header_frame_buffer_);
+StreamReader::FrameResult StreamReader::ReadFrame(FrameCanvas *frame,
+                                                  uint32_t *hold_time_us) {
+  FrameHeader h;
+  if (!ReadBytes(&h, sizeof(h))) return FRAME_FAILED;
 
   // TODO: we might allow for this to be a kFileMagicValue, to allow people
   // to just concatenate streams. In that case, we just would need to read
   // ahead past this header (both headers are designed to be same size)
   if (h.magic != kFrameMagicValue) {
-    state_ = STREAM_ERROR;
-    return false;
+    // The frame index follows the last frame.
+    if (h.magic != kIndexMagicValue) state_ = STREAM_ERROR;
+    return FRAME_FAILED;
   }
 
   // In the future, we might allow larger buffers (audio?), but never smaller.
-  // For now, we need to make sure to exactly match the size, as our assumption
-  // above is that we can read the full header + frame in one FullRead().
+  // For now, we need to make sure to exactly match the size.
   if (h.size != frame_buf_size_)
-    return false;
+    return FRAME_FAILED;
+  if (h.padding > StreamWriter::kMaxFrameAlignment || !SkipBytes(h.padding)) {
+    state_ = STREAM_ERROR;
+    return FRAME_FAILED;
+  }
+
+  // Only needed during conversion, so fine to use RGB pixels directly in
+  // any case.
+  const char *data = (zero_copy_ || is_rgb_)
+    ? io_->ReadDirect(frame_buf_size_) : NULL;
+  const bool is_direct = (data != NULL);
+  if (is_direct) {
+    position_ += frame_buf_size_;
+  } else if (ReadBytes(header_frame_buffer_, frame_buf_size_)) {
+    data = header_frame_buffer_;
+  } else {
+    return FRAME_FAILED;
+  }
+  if (!VerifyChecksum(&h, data))
+    return FRAME_SKIPPED;
 
   if (hold_time_us) *hold_time_us = h.hold_time_us;
-  return frame->Deserialize(header_frame_buffer_ + sizeof(FrameHeader),
-                            frame_buf_size_);
+
+  if (is_rgb_) {
+    SetRGBFrame(frame, data);
+    return FRAME_OK;
+  }
+
+  if (is_direct
+      && frame->framebuffer()->SetExternalBuffer(data, frame_buf_size_)) {
+    // Fault in the pages now, not later in the refresh thread.
+    for (size_t i = 0; i < frame_buf_size_; i += 4096) {
+      (void) *(volatile const char *)(data + i);
+    }
+    return FRAME_OK;
+  }
+  // Not zero-copy or not aligned.
+  return frame->Deserialize(data, frame_buf_size_) ? FRAME_OK : FRAME_FAILED;
 }
 
-bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
-  FileHeader header;
-  FullRead(io_, &header, sizeof(header));
-  if (header.magic != kFileMagicValue) {
+StreamReader::FrameResult
+StreamReader::ReadCompressedFrame(FrameCanvas *frame, uint32_t *hold_time_us) {
+  FrameHeader h;
+  if (!ReadBytes(&h, sizeof(h))) return FRAME_FAILED;
+  if (h.magic != kFrameMagicValue) {
+    if (h.magic != kIndexMagicValue) state_ = STREAM_ERROR;
+    return FRAME_FAILED;
+  }
+  const size_t words = frame_buf_size_ / sizeof(uint32_t);
+  const bool is_keyframe = (h.flags & kFrameFlagKeyframe) != 0;
+  if (h.size > MaxEncodedSize(words)
+      || h.padding > StreamWriter::kMaxFrameAlignment
+      || !SkipBytes(h.padding)) {
     state_ = STREAM_ERROR;
-    return false;
+    return FRAME_FAILED;
+  }
+  if (!ReadBytes(header_frame_buffer_, h.size))
+    return FRAME_FAILED;
+  if (!VerifyChecksum(&h, header_frame_buffer_)) {
+    have_reference_ = false;  // Wait for the next keyframe.
+    return FRAME_SKIPPED;
   }
-  if ((int)header.width != frame.width()
-      || (int)header.height != frame.height()) {
-    fprintf(stderr, "This stream is for %dx%d, can't play on %dx%d. "
-            "Please use the same settings for record/replay\n",
-            header.width, header.height, frame.width(), frame.height());
+  if (!is_keyframe && !have_reference_)
+    return FRAME_SKIPPED;
+
+  // Without frame, we only bring the reference up to date. RGB pixels are
+  // converted from the reference afterwards.
+  char *frame_data = NULL;
+  if (frame && !is_rgb_) {
+    size_t frame_len;
+    frame->framebuffer()->SerializeMutable(&frame_data, &frame_len);
+    if (frame_len != frame_buf_size_)
+      return FRAME_FAILED;
+  }
+  if (!DecodeDelta(header_frame_buffer_, h.size, is_keyframe,
+                   reference_.data(), frame_data, words)) {
+    // The reference is now in an undefined state; needs a keyframe again.
+    have_reference_ = false;
+    state_ = STREAM_ERROR;
+    return FRAME_FAILED;
+  }
+  have_reference_ = true;
+  if (frame && is_rgb_) {
+    SetRGBFrame(frame, reinterpret_cast<const char*>(reference_.data()));
+  }
+  if (hold_time_us) *hold_time_us = h.hold_time_us;
+  return FRAME_OK;
+}
+
+void StreamReader::SetRGBFrame(FrameCanvas *frame, const char *pixels) {
+  if (frame->width() != width_ || frame->height() != height_) {
+    frame->Clear();  // Not all pixels are covered.
+  }
+  // SetPixels() only reads the colors.
+  frame->SetPixels(0, 0, width_, height_,
+                   reinterpret_cast<Color*>(const_cast<char*>(pixels)));
+}
+
+bool StreamReader::IsRGB() {
+  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader()) return false;
+  return is_rgb_;
+}
+
+bool StreamReader::ReadFileHeader() {
+  FileHeader header;
+  if (!ReadBytes(&header, sizeof(header)) || header.magic != kFileMagicValue) {
     state_ = STREAM_ERROR;
     return false;
   }
-  if (header.is_wide_gpio != (sizeof(gpio_bits_t) == 8)) {
+  if (!header.is_rgb && header.is_wide_gpio != (sizeof(gpio_bits_t) == 8)) {
     fprintf(stderr, "This stream was written with %s GPIO width support but "
             "this library is compiled with %d bit GPIO width (see "
             "ENABLE_WIDE_GPIO_COMPUTE_MODULE setting in lib/Makefile)\n",
@@ -231,9 +880,394 @@ bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
     return false;
   }
   state_ = STREAM_READING;
+  width_ = header.width;
+  height_ = header.height;
   frame_buf_size_ = header.buf_size;
-  if (!header_frame_buffer_)
-    header_frame_buffer_ = new char [ sizeof(FrameHeader) + header.buf_size ];
+  is_compressed_ = header.is_delta_compressed;
+  is_rgb_ = header.is_rgb;
+  if (is_rgb_ && (frame_buf_size_ % sizeof(uint32_t) != 0
+                  || frame_buf_size_ < (size_t)width_ * height_ * 3)) {
+    state_ = STREAM_ERROR;
+    return false;
+  }
+  if (is_compressed_) {
+    reference_.resize(frame_buf_size_ / sizeof(uint32_t));
+  }
+  if (!header_frame_buffer_) {
+    const size_t max_frame_size = is_compressed_
+      ? MaxEncodedSize(frame_buf_size_ / sizeof(uint32_t))
+      : header.buf_size;
+    header_frame_buffer_ = new char [ sizeof(FrameHeader) + max_frame_size ];
+  }
   return true;
 }
+
+bool StreamReader::CheckGeometry(const FrameCanvas &frame) {
+  if (width_ == frame.width() && height_ == frame.height())
+    return true;
+  fprintf(stderr, "This stream is for %dx%d, can't play on %dx%d. "
+          "Please use the same settings for record/replay\n",
+          width_, height_, frame.width(), frame.height());
+  state_ = STREAM_ERROR;
+  return false;
+}
+
+bool StreamReader::EnsureIndex() {
+  if (index_loaded_) return !index_.empty();
+  if (io_->Size() < 0) return false;
+  index_loaded_ = true;
+  if (state_ == STREAM_AT_BEGIN) {
+    io_->Rewind();
+    position_ = 0;
+    if (!ReadFileHeader()) return false;
+  }
+  if (state_ != STREAM_READING) return false;
+  const uint64_t resume_position = position_;
+  if (!ReadTrailingIndex()) {
+    index_.clear();
+    ScanIndex();
+  }
+  // Go back to where the reader was.
+  io_->Seek(resume_position);
+  position_ = resume_position;
+  return !index_.empty();
+}
+
+bool StreamReader::ReadTrailingIndex() {
+  const off_t size = io_->Size();
+  IndexFooter footer;
+  if (size < (off_t)(sizeof(FileHeader) + sizeof(footer))
+      || !io_->Seek(size - sizeof(footer))
+      || !FullRead(io_, &footer, sizeof(footer))
+      || footer.magic != kIndexMagicValue) {
+    return false;
+  }
+  const uint64_t index_bytes = (uint64_t)footer.frame_count
+    * sizeof(StreamFrameInfo);
+  if (footer.index_offset + sizeof(IndexHeader) + index_bytes
+      + sizeof(footer) != (uint64_t)size) {
+    return false;
+  }
+  IndexHeader header;
+  if (!io_->Seek(footer.index_offset)
+      || !FullRead(io_, &header, sizeof(header))
+      || header.magic != kIndexMagicValue
+      || header.frame_count != footer.frame_count) {
+    return false;
+  }
+  index_.resize(footer.frame_count);
+  return FullRead(io_, index_.data(), index_bytes);
+}
+
+bool StreamReader::ScanIndex() {
+  uint64_t offset = sizeof(FileHeader);
+  uint64_t time_us = 0;
+  FrameHeader h;
+  while (io_->Seek(offset) && FullRead(io_, &h, sizeof(h))
+         && h.magic == kFrameMagicValue) {
+    StreamFrameInfo info;
+    info.offset = offset;
+    info.start_time_us = time_us;
+    info.hold_time_us = h.hold_time_us;
+    info.flags = h.flags;
+    index_.push_back(info);
+    time_us += h.hold_time_us;
+    offset += sizeof(h) + h.padding + h.size;
+  }
+  return !index_.empty();
+}
+
+int StreamReader::FrameCount() {
+  if (!EnsureIndex()) return -1;
+  return index_.size();
+}
+
+int64_t StreamReader::Duration() {
+  if (!EnsureIndex()) return -1;
+  const StreamFrameInfo &last = index_.back();
+  return last.start_time_us + last.hold_time_us;
+}
+
+bool StreamReader::SeekToFrame(int frame_number) {
+  if (!EnsureIndex()) return false;
+  if (frame_number < 0 || frame_number >= (int)index_.size()) return false;
+
+  // Compressed frames need the previous frame, so decode from the last
+  // keyframe on.
+  int start = frame_number;
+  if (is_compressed_) {
+    while (start > 0 && !(index_[start].flags & kFrameFlagKeyframe))
+      --start;
+  }
+  if (!io_->Seek(index_[start].offset)) return false;
+  position_ = index_[start].offset;
+  state_ = STREAM_READING;
+  have_reference_ = false;
+  for (int f = start; f < frame_number; ++f) {
+    if (ReadCompressedFrame(NULL, NULL) == FRAME_FAILED) return false;
+  }
+  return true;
+}
+
+int StreamReader::SeekToTime(int64_t time_us) {
+  if (!EnsureIndex()) return -1;
+  // First frame that starts after time_us; we want the one before.
+  struct StartsBefore {
+    bool operator()(int64_t t, const StreamFrameInfo &info) const {
+      return t < (int64_t)info.start_time_us;
+    }
+  };
+  std::vector<StreamFrameInfo>::const_iterator found
+    = std::upper_bound(index_.begin(), index_.end(), time_us, StartsBefore());
+  const int frame = (found == index_.begin()) ? 0 : (found - index_.begin()) - 1;
+  return SeekToFrame(frame) ? frame : -1;
+}
+
+StreamPlaylist::StreamPlaylist(bool loop)
+  : loop_(loop), zero_copy_(false),
+    default_checksum_interval_(StreamReader::kSampledChecksumInterval),
+    current_(0), loops_done_(0), frames_in_loop_(0), elapsed_us_(0) {}
+
+StreamPlaylist::~StreamPlaylist() {
+  for (size_t i = 0; i < readers_.size(); ++i) delete readers_[i];
+}
+
+void StreamPlaylist::Add(const Item &item) {
+  items_.push_back(item);
+  readers_.push_back(NULL);
+}
+
+void StreamPlaylist::SetZeroCopy(bool enable) {
+  zero_copy_ = enable;
+  for (size_t i = 0; i < readers_.size(); ++i) {
+    if (readers_[i]) readers_[i]->SetZeroCopy(enable);
+  }
+}
+
+void StreamPlaylist::SetDefaultChecksumInterval(int interval) {
+  default_checksum_interval_ = interval;
+  for (size_t i = 0; i < readers_.size(); ++i) {
+    if (readers_[i]) readers_[i]->SetDefaultChecksumInterval(interval);
+  }
+}
+
+void StreamPlaylist::Rewind() {
+  StartItem(0);
+}
+
+void StreamPlaylist::StartItem(int index) {
+  current_ = index;
+  loops_done_ = 0;
+  frames_in_loop_ = 0;
+  elapsed_us_ = 0;
+  if (index < (int)readers_.size() && readers_[index] != NULL)
+    readers_[index]->Rewind();  // Might have been left in the middle.
+}
+
+int StreamPlaylist::corrupt_frames() const {
+  int result = 0;
+  for (size_t i = 0; i < readers_.size(); ++i) {
+    if (readers_[i]) result += readers_[i]->corrupt_frames();
+  }
+  return result;
+}
+
+bool StreamPlaylist::GetNext(FrameCanvas *frame, uint32_t *hold_time_us,
+                             int *item) {
+  int items_without_frames = 0;  // Don't spin on empty or broken streams.
+  while (current_ < (int)items_.size()) {
+    const Item &it = items_[current_];
+    StreamReader *&reader = readers_[current_];
+    if (reader == NULL) {
+      reader = new StreamReader(it.stream);
+      reader->SetZeroCopy(zero_copy_);
+      reader->SetDefaultChecksumInterval(default_checksum_interval_);
+    }
+    const bool time_is_up = (it.max_duration_us >= 0
+                             && elapsed_us_ >= it.max_duration_us);
+    uint32_t hold;
+    if (!time_is_up && reader->GetNext(frame, &hold)) {
+      if (it.hold_time_us >= 0) hold = it.hold_time_us;
+      elapsed_us_ += hold;
+      ++frames_in_loop_;
+      if (hold_time_us) *hold_time_us = hold;
+      if (item) *item = current_;
+      return true;
+    }
+    if (!time_is_up && frames_in_loop_ > 0) {
+      ++loops_done_;
+      if (it.loops < 0 || loops_done_ < it.loops) {
+        reader->Rewind();
+        frames_in_loop_ = 0;
+        continue;
+      }
+    }
+
+    // Done with this item.
+    const bool had_frames = loops_done_ > 0 || frames_in_loop_ > 0;
+    items_without_frames = had_frames ? 0 : items_without_frames + 1;
+    if (items_without_frames >= (int)items_.size()) return false;
+    int next = current_ + 1;
+    if (next == (int)items_.size() && loop_) next = 0;
+    StartItem(next);
+  }
+  return false;
+}
+
+class PrefetchingStreamReader::ReaderThread : public Thread {
+public:
+  explicit ReaderThread(PrefetchingStreamReader *parent) : parent_(parent) {}
+  void Run() final { parent_->ReadLoop(); }
+
+private:
+  PrefetchingStreamReader *const parent_;
+};
+
+PrefetchingStreamReader::PrefetchingStreamReader(
+  StreamReader *reader, const std::vector<FrameCanvas*> &canvases, bool loop)
+  : reader_(reader), playlist_(NULL), loop_(loop), thread_(NULL),
+    free_(canvases), running_(true), finished_(false), delivered_(false),
+    underruns_(0), corrupt_frames_(0) {
+  // Verifying here does not hold up playback, so check all frames.
+  reader_->SetDefaultChecksumInterval(1);
+  pthread_cond_init(&changed_, NULL);
+  thread_ = new ReaderThread(this);
+  thread_->Start();
+}
+
+PrefetchingStreamReader::PrefetchingStreamReader(
+  StreamPlaylist *playlist, const std::vector<FrameCanvas*> &canvases)
+  : reader_(NULL), playlist_(playlist), loop_(false), thread_(NULL),
+    free_(canvases), running_(true), finished_(false), delivered_(false),
+    underruns_(0), corrupt_frames_(0) {
+  playlist_->SetDefaultChecksumInterval(1);
+  pthread_cond_init(&changed_, NULL);
+  thread_ = new ReaderThread(this);
+  thread_->Start();
+}
+
+PrefetchingStreamReader::~PrefetchingStreamReader() {
+  Stop(NULL);
+  // Reading continues in the caller's thread, if at all.
+  if (reader_) {
+    reader_->SetDefaultChecksumInterval(StreamReader::kSampledChecksumInterval);
+  } else {
+    playlist_->SetDefaultChecksumInterval(
+      StreamReader::kSampledChecksumInterval);
+  }
+  pthread_cond_destroy(&changed_);
+}
+
+void PrefetchingStreamReader::ReadLoop() {
+  int frames_since_rewind = 0;
+  for (;;) {
+    FrameCanvas *canvas;
+    {
+      MutexLock l(&mutex_);
+      while (running_ && free_.empty())
+        mutex_.WaitOn(&changed_);
+      if (!running_) break;
+      canvas = free_.back();
+      free_.pop_back();
+    }
+
+    // The slow part, outside the lock.
+    ReadyFrame frame = { canvas, 0, 0 };
+    const bool success = playlist_
+      ? playlist_->GetNext(canvas, &frame.hold_time_us, &frame.item)
+      : reader_->GetNext(canvas, &frame.hold_time_us);
+    const int corrupt_frames = playlist_
+      ? playlist_->corrupt_frames()
+      : reader_->corrupt_frames();
+    bool done = false;
+    if (success) {
+      ++frames_since_rewind;
+    } else {
+      frame.canvas = NULL;
+      // Don't spin on empty or broken streams.
+      done = !loop_ || frames_since_rewind == 0;
+      if (!done) reader_->Rewind();
+      frames_since_rewind = 0;
+    }
+
+    MutexLock l(&mutex_);
+    corrupt_frames_ = corrupt_frames;
+    if (!success) free_.push_back(canvas);
+    ready_.push_back(frame);
+    finished_ = done;
+    pthread_cond_broadcast(&changed_);
+    if (done) break;
+  }
+  MutexLock l(&mutex_);
+  finished_ = true;
+  pthread_cond_broadcast(&changed_);
+}
+
+bool PrefetchingStreamReader::GetNext(FrameCanvas **frame,
+                                      uint32_t *hold_time_us, int *item) {
+  MutexLock l(&mutex_);
+  if (ready_.empty() && !finished_) {
+    if (delivered_) ++underruns_;
+    while (ready_.empty() && !finished_)
+      mutex_.WaitOn(&changed_);
+  }
+  if (ready_.empty()) return false;
+  const ReadyFrame ready = ready_.front();
+  ready_.pop_front();
+  if (ready.canvas == NULL) return false;  // End of stream.
+  *frame = ready.canvas;
+  if (hold_time_us) *hold_time_us = ready.hold_time_us;
+  if (item) *item = ready.item;
+  delivered_ = true;
+  return true;
+}
+
+void PrefetchingStreamReader::Release(FrameCanvas *canvas) {
+  if (canvas == NULL) return;
+  MutexLock l(&mutex_);
+  free_.push_back(canvas);
+  pthread_cond_broadcast(&changed_);
+}
+
+void PrefetchingStreamReader::Stop(std::vector<FrameCanvas*> *canvases) {
+  if (thread_) {
+    {
+      MutexLock l(&mutex_);
+      running_ = false;
+      pthread_cond_broadcast(&changed_);
+    }
+    thread_->WaitStopped();
+    delete thread_;
+    thread_ = NULL;
+  }
+  MutexLock l(&mutex_);
+  for (size_t i = 0; i < ready_.size(); ++i) {
+    if (ready_[i].canvas) free_.push_back(ready_[i].canvas);
+  }
+  ready_.clear();
+  finished_ = true;
+  if (canvases) {
+    canvases->insert(canvases->end(), free_.begin(), free_.end());
+  }
+  free_.clear();
+}
+
+int PrefetchingStreamReader::ready_frames() {
+  MutexLock l(&mutex_);
+  int result = 0;
+  for (size_t i = 0; i < ready_.size(); ++i) {
+    if (ready_[i].canvas) ++result;
+  }
+  return result;
+}
+
+int PrefetchingStreamReader::underruns() {
+  MutexLock l(&mutex_);
+  return underruns_;
+}
+
+int PrefetchingStreamReader::corrupt_frames() {
+  MutexLock l(&mutex_);
+  return corrupt_frames_;
+}
 }  // namespace rgb_matrix
@@ -18,48 +18,157 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "hardware-mapping.h"
 #include "../include/graphics.h"
 
 namespace rgb_matrix {
 class GPIO;
 class PinPulser;
+class PixelMapper;
 namespace internal {
-class RowAddressSetter;
 
-// An opaque type used within the framebuffer that can be used
-// to copy between PixelMappers.
-struct PixelDesignator {
-  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0u){}
-  long gpio_word;
+// Different panel types use different techniques to set the row address.
+// We abstract that away with different implementations of RowAddressSetter
+class RowAddressSetter {
+public:
+  virtual ~RowAddressSetter() {}
+  virtual gpio_bits_t need_bits() const = 0;
+  virtual void SetRowAddress(GPIO *io, int row) = 0;
+};
+
+// Create the RowAddressSetter for the given row_address_type (see
+// --led-row-addr-type) with "double_rows" rows to address.
+// Returns NULL if the type is unknown.
+RowAddressSetter *CreateRowAddressSetter(int row_address_type,
+                                         int double_rows,
+                                         const HardwareMapping &h);
+
+// Color correction of a panel (see --led-panel-calibration). Each 8 bit
+// input channel is first raised to its "gamma"; the light output then is
+// "matrix" applied to the light the corrected channels would give.
+struct ColorCalibration {
+  float matrix[3][3];  // Rows: output red, green, blue.
+  float gamma[3];
+};
+
+// The GPIO bits a pixel sets for each color, and the mask to clear them.
+// Only a few different ones exist: one per parallel chain and upper/lower
+// half of the panel, and with calibration, per panel.
+struct ColorBits {
+  ColorBits() : r_bit(0), g_bit(0), b_bit(0), mask(~0u), calibration(-1) {}
   gpio_bits_t r_bit;
   gpio_bits_t g_bit;
   gpio_bits_t b_bit;
   gpio_bits_t mask;
+  int32_t calibration;  // Index in PixelDesignatorMap::calibrations() or -1
+};
+
+// An opaque type used within the framebuffer that can be used
+// to copy between PixelMappers. Kept small, as there is one for each
+// pixel: the color bits are an index into the table of the
+// PixelDesignatorMap.
+struct PixelDesignator {
+  static constexpr uint32_t kUnused = 0xffffffff;  // Pixel not shown.
+  PixelDesignator() : gpio_word(kUnused), color_bits(0) {}
+  uint32_t gpio_word;   // Offset in the bitplane buffer.
+  uint32_t color_bits;  // Index into PixelDesignatorMap::color_bits()
+};
+
+// Consecutive pixels of a row that use the same color bits and whose GPIO
+// words are a constant "stride" apart. Most mappings (rotations, mirrors,
+// chain arrangements) consist of few, long runs; bulk operations can then
+// work on a whole run at once instead of looking up each pixel.
+struct PixelRun {
+  int x;               // First pixel of the run.
+  int length;
+  uint32_t gpio_word;  // Of the first pixel.
+  int32_t stride;      // GPIO words from one pixel to the next.
+  uint32_t color_bits;
 };
 
 class PixelDesignatorMap {
 public:
-  PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits);
+  PixelDesignatorMap(int width, int height, const ColorBits &fill_bits);
+
+  // New map of the given size sharing the color bits of "parent", so that
+  // PixelDesignators can be copied from there.
+  PixelDesignatorMap(int width, int height, const PixelDesignatorMap &parent);
   ~PixelDesignatorMap();
 
   // Get a writable version of the PixelDesignator. Outside Framebuffer used
   // by the RGBMatrix to re-assign mappings to new PixelDesignatorMappers.
   PixelDesignator *get(int x, int y);
+  const PixelDesignator *get(int x, int y) const {
+    return const_cast<PixelDesignatorMap*>(this)->get(x, y);
+  }
 
   inline int width() const { return width_; }
   inline int height() const { return height_; }
 
   // All bits that set red/green/blue pixels; used for Fill().
-  const PixelDesignator &GetFillColorBits() { return fill_bits_; }
+  const ColorBits &GetFillColorBits() const { return fill_bits_; }
+
+  // Color bits referenced by PixelDesignator::color_bits.
+  const ColorBits &color_bits(uint32_t index) const {
+    return color_bits_[index];
+  }
+
+  // Index of "bits" in the table, adding them if not there yet.
+  uint32_t AddColorBits(const ColorBits &bits);
+
+  // Calibrations referenced by ColorBits::calibration. Shared with all maps
+  // created from this one; NULL if there are none.
+  typedef std::vector<ColorCalibration> CalibrationList;
+  const std::shared_ptr<const CalibrationList> &calibrations() const {
+    return calibrations_;
+  }
+  void SetCalibrations(const std::shared_ptr<const CalibrationList> &c) {
+    calibrations_ = c;
+  }
+
+  // Analyze the map into PixelRuns. Needs to be called once all
+  // designators are set, before the map is used.
+  void ComputeRuns();
+
+  // The runs of row "y", ordered by x, in "*count". Pixels that are not
+  // shown are not part of any run.
+  const PixelRun *GetRowRuns(int y, int *count) const {
+    *count = row_runs_[y + 1] - row_runs_[y];
+    return runs_.data() + row_runs_[y];
+  }
+  int run_count() const { return runs_.size(); }
 
 private:
   const int width_;
   const int height_;
-  const PixelDesignator fill_bits_;  // Precalculated for fill.
-  PixelDesignator *const buffer_;
+  const ColorBits fill_bits_;  // Precalculated for fill.
+  std::vector<ColorBits> color_bits_;
+  std::shared_ptr<const CalibrationList> calibrations_;
+  PixelDesignator *const buffer_;  // Row by row.
+  std::vector<PixelRun> runs_;
+  std::vector<uint32_t> row_runs_;  // Index of first run of each row.
 };
 
+// Create the mapping resulting from applying all "mappers" in sequence to
+// "base", in a single pass over the result. NULL entries and mappers that
+// don't accept the size are skipped; "all_applied" is false if there were
+// any of the latter. Returns NULL if there is nothing to apply.
+PixelDesignatorMap *CreateMappedPixels(
+  const PixelDesignatorMap &base,
+  const std::vector<const PixelMapper*> &mappers, bool *all_applied);
+
+// Create a copy of the physical layout "base" of "chain" x "parallel" panels
+// in which the pixels of each panel listed in the calibration file
+// "filename" use that panel's ColorCalibration. Returns NULL if the file
+// can't be read or has errors.
+PixelDesignatorMap *CreateCalibratedPixels(const PixelDesignatorMap &base,
+                                           const char *filename,
+                                           int chain, int parallel);
+
 // Internal representation of the frame-buffer that as well can
 // write itself to GPIO.
 // Our internal memory layout mimicks as much as possible what needs to be
@@ -87,9 +196,49 @@ public:
   Framebuffer(int rows, int columns, int parallel,
               int scan_mode,
               const char* led_sequence, bool inverse_color,
-              PixelDesignatorMap **mapper);
+              const std::shared_ptr<PixelDesignatorMap> &mapper);
   ~Framebuffer();
 
+  // The pixel mapping this Framebuffer draws with. If none was passed to
+  // the constructor, it is the physical layout of the panels.
+  const std::shared_ptr<PixelDesignatorMap> &pixel_mapper() const {
+    return mapper_;
+  }
+
+  // Draw with "mapper" from now on. Must not be called while another thread
+  // draws into this Framebuffer. Content drawn with another mapping is laid
+  // out differently, so a change counts as full damage.
+  void SetPixelMapper(const std::shared_ptr<PixelDesignatorMap> &mapper) {
+    std::atomic_store(&pending_mapper_,
+                      std::shared_ptr<PixelDesignatorMap>());
+    has_pending_mapper_.store(false, std::memory_order_release);
+    if (mapper == mapper_) return;
+    mapper_ = mapper;
+    AddFullDamage();
+  }
+
+  // Hand "mapper" to the thread drawing into this Framebuffer, which
+  // switches to it in its next AdoptPendingPixelMapper(). Unlike
+  // SetPixelMapper(), this can be called while drawing goes on.
+  void SetPendingPixelMapper(const std::shared_ptr<PixelDesignatorMap> &mapper) {
+    std::atomic_store(&pending_mapper_, mapper);
+    has_pending_mapper_.store(true, std::memory_order_release);
+  }
+
+  // Called by the drawing thread between drawing calls. The old map is
+  // released here, so never while it is in use.
+  void AdoptPendingPixelMapper() {
+    if (!has_pending_mapper_.load(std::memory_order_acquire)) return;
+    has_pending_mapper_.store(false, std::memory_order_relaxed);
+    std::shared_ptr<PixelDesignatorMap> pending(
+      std::atomic_exchange(&pending_mapper_,
+                           std::shared_ptr<PixelDesignatorMap>()));
+    if (pending && pending != mapper_) {
+      mapper_ = pending;
+      AddFullDamage();
+    }
+  }
+
   // Initialize GPIO bits for output. Only call once.
   static void InitHardwareMapping(const char *named_hardware);
   static void InitGPIO(GPIO *io, int rows, int parallel,
@@ -105,6 +254,22 @@ public:
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits() { return pwm_bits_; }
 
+  // Spatial dithering of the color bits that are not shown with the
+  // current PWM bits, by adding a threshold from a pattern before they are
+  // cut off. See --led-dither.
+  enum DitherMode { kNoDither, kBayerDither, kBlueNoiseDither };
+  void SetDither(DitherMode mode);
+
+  // Mode for "none", "bayer" or "blue-noise"; NULL or empty is "none".
+  // Returns false for unknown names.
+  static bool DitherModeFromName(const char *name, DitherMode *mode);
+
+  // Move the dither pattern for the next frame; with a different "frame"
+  // each time, the pattern averages out over time as well.
+  void set_dither_frame(uint32_t frame) {
+    dither_offset_ = frame * 159;  // 256 / golden ratio.
+  }
+
   // Map brightness of output linearly to input with CIE1931 profile.
   void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
   bool luminance_correct() const { return do_luminance_correct_; }
@@ -116,12 +281,60 @@ public:
   }
   uint8_t brightness() { return brightness_; }
 
+  // Set brightness in percent (1..100) by scaling the on-time of all
+  // bitplanes. Unlike SetBrightness(), this applies to whatever is displayed
+  // from the next refresh on, without re-rendering any content.
+  static void SetHardwareBrightness(uint8_t brightness);
+
+  // Limit the estimated LED load (see EstimatePowerLoad()) of displayed frames
+  // to "max_load" (0..1) by shortening the bitplane on-time of frames
+  // exceeding it. 0 switches off limiting.
+  static void SetPowerLimit(float max_load);
+
+  // Factor the on-time was reduced by the power limit for the frame
+  // displayed last (1.0 = not limited).
+  static float power_limit_scale();
+
+  // Estimate the LED load of this frame from the number of LEDs switched on
+  // in each bitplane, weighted with the time each bitplane is shown.
+  // Returns a value from 0 (all off) to 1 (all LEDs full white) and
+  // remembers it for the power limit applied in DumpToMatrix().
+  float EstimatePowerLoad();
+  float power_load() const { return power_load_; }
+
+  // The same estimate, spread over several calls: each looks at the next
+  // "rows" double rows and the estimate is updated after the last one.
+  // For the refresh thread, which can't afford a full pass at once.
+  void ContinuePowerEstimate(int rows);
+
   void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
 
   void Serialize(const char **data, size_t *len) const;
+  // Like Serialize(), but writable, so that content can be decoded directly
+  // into the buffer.
+  void SerializeMutable(char **data, size_t *len);
   bool Deserialize(const char *data, size_t len);
   void CopyFrom(const Framebuffer *other);
 
+  // Like Deserialize(), but instead of copying, use "data" directly as
+  // bitplane buffer (e.g. a memory mapped stream). The memory is only read
+  // and needs to stay valid while this frame is in use. Any change to the
+  // content switches back to the own buffer.
+  // Returns 'false' if the size is unexpected or the data not aligned.
+  bool SetExternalBuffer(const char *data, size_t len);
+
+  // Declare the area that changed; switches on damage tracking (see
+  // FrameCanvas::AddDamage()). Clear(), Fill() and other changes of the
+  // whole buffer then damage everything.
+  void AddDamage(int x, int y, int width, int height);
+  void AddFullDamage();
+  bool tracks_damage() const { return track_damage_; }
+
+  // Bring "other", which had the content of this Framebuffer before the
+  // damage, up to date by copying only the damaged parts of each row.
+  // Both have no damage afterwards.
+  void CopyDamageTo(Framebuffer *other);
+
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
   int width() const;
@@ -142,10 +355,31 @@ private:
                                             gpio_bits_t default_g,
                                             gpio_bits_t default_b);
 
-  void InitDefaultDesignator(int x, int y, const char *led_sequence,
-                             PixelDesignator *designator);
-  inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
+  // Set up "map" with the physical layout of this Framebuffer.
+  void InitDefaultDesignators(const char *led_sequence,
+                              PixelDesignatorMap *map);
+  // Map colors to bitplane values, adding "dither" (see DitherAt()).
+  inline void  MapColors(uint8_t r, uint8_t g, uint8_t b, uint16_t dither,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+
+  // The dither threshold in bitplane units for pixel x, y; 0 without
+  // dithering.
+  inline uint16_t DitherAt(int x, int y) const;
+
+  // Encode table of a ColorCalibration for the current brightness: the
+  // bitplane value of each output channel is the sum of the entries of the
+  // three input channels.
+  struct CalibrationTable {
+    int32_t value[3][3][256];  // [output][input][input value]
+    bool diagonal;             // Only value[i][i] is non-zero.
+  };
+  // The tables for the calibrations of mapper_, built on first use.
+  inline const CalibrationTable *GetCalibrationTables();
+  void BuildCalibrationTables();
+  inline void MapCalibratedColors(const CalibrationTable &table,
+                                  uint8_t r, uint8_t g, uint8_t b,
+                                  uint16_t dither, uint16_t *red,
+                                  uint16_t *green, uint16_t *blue);
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
@@ -156,7 +390,14 @@ private:
 
   uint8_t pwm_bits_;   // PWM bits to display.
   bool do_luminance_correct_;
+  const uint8_t *dither_pattern_;  // Thresholds 0..255 or NULL.
+  uint8_t dither_offset_;          // Added to the pattern for this frame.
   uint8_t brightness_;
+  // Last result of EstimatePowerLoad() or ContinuePowerEstimate(); written
+  // by the caller of SwapOnVSync() and the refresh thread.
+  std::atomic<float> power_load_;
+  int estimate_row_;   // Next double row for ContinuePowerEstimate()
+  uint64_t estimate_on_;  // Weighted on-bits of the rows before it.
 
   const int double_rows_;
   const size_t buffer_size_;
@@ -167,10 +408,44 @@ private:
   // Each bitplane-column is pre-filled IoBits, of which the colors are set.
   // Of course, that means that we store unrelated bits in the frame-buffer,
   // but it allows easy access in the critical section.
-  gpio_bits_t *bitplane_buffer_;
+  gpio_bits_t *bitplane_buffer_;      // Either owned_buffer_ or external.
+  gpio_bits_t *const owned_buffer_;
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
-  PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
+  // Bits switched on in double rows first_row..end_row-1 and in all
+  // double rows, weighted with the time each bitplane is shown.
+  uint64_t WeightedOnBits(int first_row, int end_row);
+  uint64_t WeightedTotalBits() const;
+
+  // Switch bitplane_buffer_ back to owned_buffer_ if it refers to
+  // external memory. Copy the content if "keep_content".
+  inline void UseOwnBuffer(bool keep_content) {
+    if (bitplane_buffer_ != owned_buffer_) SwitchToOwnBuffer(keep_content);
+  }
+  void SwitchToOwnBuffer(bool keep_content);
+
+  // Damage tracking: the damaged columns of each double row.
+  struct DamageSpan {
+    int first, last;  // Nothing damaged if first > last.
+  };
+  inline void MarkDamaged(uint32_t first_word, uint32_t last_word);
+  void ResetDamage();
+  bool track_damage_;
+  bool full_damage_;
+  std::vector<DamageSpan> damage_;
+
+  // Shared with other Framebuffers; a map is freed once no Framebuffer uses
+  // it anymore.
+  std::shared_ptr<PixelDesignatorMap> mapper_;
+  std::shared_ptr<PixelDesignatorMap> pending_mapper_;  // atomic access.
+  std::atomic<bool> has_pending_mapper_;
+
+  // Calibrations, brightness and luminance correction calibration_tables_
+  // were built for.
+  std::vector<CalibrationTable> calibration_tables_;
+  std::shared_ptr<const PixelDesignatorMap::CalibrationList> tables_source_;
+  uint8_t tables_brightness_;
+  bool tables_luminance_correct_;
 };
 }  // namespace internal
 }  // namespace rgb_matrix
@@ -28,9 +28,12 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <vector>
 
 #include "gpio.h"
 #include "../include/graphics.h"
+#include "../include/pixel-mapper.h"
 
 namespace rgb_matrix {
 namespace internal {
@@ -38,6 +41,18 @@ namespace internal {
 // implementations depending on the context.
 static PinPulser *sOutputEnablePulser = NULL;
 
+// Pulse scale requested with SetHardwareBrightness(). It is picked up by the
+// refresh thread in DumpToMatrix() while no pulse is in flight.
+static std::atomic<float> sRequestedPulseScale(1.0f);
+static float sAppliedPulseScale = 1.0f;
+
+// Maximum LED load before frames are dimmed. 0 = no limit.
+static float sPowerLimit = 0;
+static constexpr int kPowerLimitSteps = 64;  // Resolution of the limiting.
+
+// Relative time each bitplane is shown. Used to weight the LED load.
+static uint32_t sBitplaneWeights[Framebuffer::kBitPlanes];
+
 #ifdef ONLY_SINGLE_SUB_PANEL
 #  define SUB_PANELS_ 1
 #else
@@ -51,62 +66,322 @@ PixelDesignator *PixelDesignatorMap::get(int x, int y) {
 }
 
 PixelDesignatorMap::PixelDesignatorMap(int width, int height,
-                                       const PixelDesignator &fill_bits)
+                                       const ColorBits &fill_bits)
   : width_(width), height_(height), fill_bits_(fill_bits),
     buffer_(new PixelDesignator[width * height]) {
 }
 
+PixelDesignatorMap::PixelDesignatorMap(int width, int height,
+                                       const PixelDesignatorMap &parent)
+  : width_(width), height_(height), fill_bits_(parent.fill_bits_),
+    color_bits_(parent.color_bits_), calibrations_(parent.calibrations_),
+    buffer_(new PixelDesignator[width * height]) {
+}
+
 PixelDesignatorMap::~PixelDesignatorMap() {
   delete [] buffer_;
 }
 
-// Different panel types use different techniques to set the row address.
-// We abstract that away with different implementations of RowAddressSetter
-class RowAddressSetter {
-public:
-  virtual ~RowAddressSetter() {}
-  virtual gpio_bits_t need_bits() const = 0;
-  virtual void SetRowAddress(GPIO *io, int row) = 0;
-};
+uint32_t PixelDesignatorMap::AddColorBits(const ColorBits &bits) {
+  for (size_t i = 0; i < color_bits_.size(); ++i) {
+    const ColorBits &c = color_bits_[i];
+    if (c.r_bit == bits.r_bit && c.g_bit == bits.g_bit
+        && c.b_bit == bits.b_bit && c.mask == bits.mask
+        && c.calibration == bits.calibration) {
+      return i;
+    }
+  }
+  color_bits_.push_back(bits);
+  return color_bits_.size() - 1;
+}
+
+void PixelDesignatorMap::ComputeRuns() {
+  runs_.clear();
+  row_runs_.resize(height_ + 1);
+  for (int y = 0; y < height_; ++y) {
+    row_runs_[y] = runs_.size();
+    const PixelDesignator *row = buffer_ + y * width_;
+    PixelRun *run = NULL;
+    for (int x = 0; x < width_; ++x) {
+      const PixelDesignator &d = row[x];
+      if (d.gpio_word == PixelDesignator::kUnused) {
+        run = NULL;
+        continue;
+      }
+      if (run != NULL && d.color_bits == run->color_bits) {
+        const int32_t stride = (int32_t)(d.gpio_word - row[x-1].gpio_word);
+        if (run->length == 1) run->stride = stride;
+        if (stride == run->stride) {
+          run->length++;
+          continue;
+        }
+      }
+      const PixelRun new_run = { x, 1, d.gpio_word, 0, d.color_bits };
+      runs_.push_back(new_run);
+      run = &runs_.back();
+    }
+  }
+  row_runs_[height_] = runs_.size();
+}
+
+PixelDesignatorMap *CreateMappedPixels(
+  const PixelDesignatorMap &base,
+  const std::vector<const PixelMapper*> &mappers, bool *all_applied) {
+  // The chain of mappers to apply and the size of the map before each of
+  // them; the last size is the resulting one.
+  std::vector<const PixelMapper*> chain;
+  std::vector<int> widths(1, base.width());
+  std::vector<int> heights(1, base.height());
+  *all_applied = true;
+  for (size_t i = 0; i < mappers.size(); ++i) {
+    if (mappers[i] == NULL) continue;
+    int new_width, new_height;
+    if (!mappers[i]->GetSizeMapping(widths.back(), heights.back(),
+                                    &new_width, &new_height)) {
+      *all_applied = false;
+      continue;
+    }
+    chain.push_back(mappers[i]);
+    widths.push_back(new_width);
+    heights.push_back(new_height);
+  }
+  if (chain.empty()) return NULL;
+
+  // Trace each pixel of the resulting map back through the whole chain, so
+  // that no intermediate maps are needed.
+  const int new_width = widths.back();
+  const int new_height = heights.back();
+  PixelDesignatorMap *result = new PixelDesignatorMap(new_width, new_height,
+                                                      base);
+  int errors = 0;
+  for (int y = 0; y < new_height; ++y) {
+    for (int x = 0; x < new_width; ++x) {
+      int map_x = x, map_y = y;
+      bool shown = true;
+      for (int i = chain.size() - 1; shown && i >= 0; --i) {
+        int orig_x = -1, orig_y = -1;
+        chain[i]->MapVisibleToMatrix(widths[i], heights[i],
+                                     map_x, map_y, &orig_x, &orig_y);
+        if (orig_x == -1 && orig_y == -1) {
+          shown = false;  // Gap in the arrangement.
+        } else if (orig_x < 0 || orig_y < 0 ||
+                   orig_x >= widths[i] || orig_y >= heights[i]) {
+          if (errors++ == 0) {  // A broken mapper would flood the output.
+            fprintf(stderr, "Error in PixelMapper %s: (%d, %d) -> (%d, %d) "
+                    "[range: %dx%d]\n", chain[i]->GetName(), map_x, map_y,
+                    orig_x, orig_y, widths[i], heights[i]);
+          }
+          shown = false;
+        }
+        map_x = orig_x;
+        map_y = orig_y;
+      }
+      if (shown) {
+        *result->get(x, y) = *base.get(map_x, map_y);
+      }
+    }
+  }
+  if (errors > 1) {
+    fprintf(stderr, "... and %d more pixels mapped out of range.\n",
+            errors - 1);
+  }
+  result->ComputeRuns();
+  return result;
+}
+
+// Panel index from the calibration file: a number below "count" or "*" for
+// all, which is returned as -1.
+static bool ParsePanelIndex(const char *str, int count, int *index) {
+  if (strcmp(str, "*") == 0) {
+    *index = -1;
+    return true;
+  }
+  char *end;
+  *index = strtol(str, &end, 10);
+  return *end == '\0' && end != str && *index >= 0 && *index < count;
+}
+
+// The calibration file has one line per panel:
+//   <chain-position> <parallel> <values>
+// The values are three gains for red, green and blue, or a full 3x3 matrix
+// row by row; either optionally followed by three gamma values. A '*' as
+// position applies to all panels in that direction; later lines override
+// earlier ones. '#' starts a comment.
+PixelDesignatorMap *CreateCalibratedPixels(const PixelDesignatorMap &base,
+                                           const char *filename,
+                                           int chain, int parallel) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  std::shared_ptr<PixelDesignatorMap::CalibrationList> calibrations(
+    new PixelDesignatorMap::CalibrationList());
+  std::vector<int> panel_calibration(chain * parallel, -1);
+  bool success = true;
+  char line[1024];
+  for (int line_no = 1; success && fgets(line, sizeof(line), f); ++line_no) {
+    char *const comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    std::vector<const char*> tokens;
+    for (char *t = strtok(line, " \t\r\n"); t; t = strtok(NULL, " \t\r\n")) {
+      tokens.push_back(t);
+    }
+    if (tokens.empty()) continue;
+
+    const int count = (int)tokens.size() - 2;
+    float v[12];
+    int chain_pos = 0, parallel_pos = 0;
+    success = (count == 3 || count == 6 || count == 9 || count == 12)
+      && ParsePanelIndex(tokens[0], chain, &chain_pos)
+      && ParsePanelIndex(tokens[1], parallel, &parallel_pos);
+    for (int i = 0; success && i < count; ++i) {
+      char *end;
+      v[i] = strtof(tokens[i + 2], &end);
+      success = (*end == '\0' && end != tokens[i + 2]);
+    }
+    const bool has_gamma = (count == 6 || count == 12);
+    for (int i = 0; success && has_gamma && i < 3; ++i) {
+      success = (v[count - 3 + i] > 0);
+    }
+    if (!success) {
+      fprintf(stderr, "%s:%d: Expected <chain-position> <parallel> (0..%d, "
+              "0..%d or '*') followed by 3 gains or 9 matrix values, "
+              "optionally followed by 3 gamma values.\n", filename, line_no,
+              chain - 1, parallel - 1);
+      break;
+    }
+
+    ColorCalibration c;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        c.matrix[i][j] = (count >= 9) ? v[3*i + j] : (i == j ? v[i] : 0);
+      }
+      c.gamma[i] = has_gamma ? v[count - 3 + i] : 1.0f;
+    }
+    calibrations->push_back(c);
+    for (int p = 0; p < parallel; ++p) {
+      if (parallel_pos >= 0 && p != parallel_pos) continue;
+      for (int ch = 0; ch < chain; ++ch) {
+        if (chain_pos >= 0 && ch != chain_pos) continue;
+        panel_calibration[p * chain + ch] = calibrations->size() - 1;
+      }
+    }
+  }
+  fclose(f);
+  if (!success) return NULL;
+
+  PixelDesignatorMap *result = new PixelDesignatorMap(base.width(),
+                                                      base.height(), base);
+  result->SetCalibrations(calibrations);
+  const int panel_cols = base.width() / chain;
+  const int panel_rows = base.height() / parallel;
+  for (int y = 0; y < base.height(); ++y) {
+    for (int x = 0; x < base.width(); ++x) {
+      *result->get(x, y) = *base.get(x, y);
+    }
+    for (int ch = 0; ch < chain; ++ch) {
+      const int calibration = panel_calibration[(y / panel_rows) * chain + ch];
+      if (calibration < 0) continue;
+      // All pixels of a panel row mostly have the same color bits.
+      uint32_t last_bits = PixelDesignator::kUnused, calibrated_bits = 0;
+      for (int x = ch * panel_cols; x < (ch + 1) * panel_cols; ++x) {
+        PixelDesignator *d = result->get(x, y);
+        if (d->gpio_word == PixelDesignator::kUnused) continue;
+        if (d->color_bits != last_bits) {
+          last_bits = d->color_bits;
+          ColorBits bits = base.color_bits(last_bits);
+          bits.calibration = calibration;
+          calibrated_bits = result->AddColorBits(bits);
+        }
+        d->color_bits = calibrated_bits;
+      }
+    }
+  }
+  result->ComputeRuns();
+  return result;
+}
 
 namespace {
 
+// Base for all RowAddressSetters. Each of them precomputes, per row, the
+// sequence of GPIO transitions needed to address it, so that SetRowAddress()
+// in the critical path only has to play back a table.
+//
+// There are two sequences per row: the full one, that gets to the row from
+// whatever state the address lines are in, and optionally a shorter one
+// that only works if the previous row was addressed right before (e.g.
+// shifting in a single bit on shift-register based panels). As rows are
+// mostly addressed in ascending order, that is the common case.
+class SequenceRowAddressSetter : public RowAddressSetter {
+public:
+  virtual gpio_bits_t need_bits() const { return row_mask_; }
+
+  virtual void SetRowAddress(GPIO *io, int row) {
+    if (row == last_row_) return;
+    const Sequence &seq = (row == last_row_ + 1 && !next_[row].empty())
+      ? next_[row]
+      : full_[row];
+    for (size_t i = 0; i < seq.size(); ++i) {
+      io->ClearAndSetBits(seq[i].clear, seq[i].set);
+    }
+    last_row_ = row;
+  }
+
+protected:
+  // A single transition: first clear, then set the given bits.
+  struct Step {
+    gpio_bits_t clear;
+    gpio_bits_t set;
+  };
+  typedef std::vector<Step> Sequence;
+
+  SequenceRowAddressSetter(int double_rows, gpio_bits_t row_mask)
+    : row_mask_(row_mask), last_row_(-1) {
+    assert(double_rows <= kMaxDoubleRows);
+  }
+
+  static void AddStep(Sequence *seq, gpio_bits_t clear, gpio_bits_t set) {
+    Step step = { clear, set };
+    seq->push_back(step);
+  }
+
+  // Bring all bits in "mask" to the level given in "value" in one step.
+  static void AddMaskedStep(Sequence *seq, gpio_bits_t value,
+                            gpio_bits_t mask) {
+    AddStep(seq, ~value & mask, value & mask);
+  }
+
+  static constexpr int kMaxDoubleRows = 32;
+
+  gpio_bits_t row_mask_;
+  Sequence full_[kMaxDoubleRows];   // Sequence to get to row from anywhere.
+  Sequence next_[kMaxDoubleRows];   // ..from row-1; empty if not possible.
+
+private:
+  int last_row_;
+};
+
 // The default DirectRowAddressSetter just sets the address in parallel
 // output lines ABCDE with A the LSB and E the MSB.
-class DirectRowAddressSetter : public RowAddressSetter {
+class DirectRowAddressSetter : public SequenceRowAddressSetter {
 public:
   DirectRowAddressSetter(int double_rows, const HardwareMapping &h)
-    : row_mask_(0), last_row_(-1) {
-    assert(double_rows <= 32);  // need to resize row_lookup_
+    : SequenceRowAddressSetter(double_rows, 0) {
     if (double_rows > 16) row_mask_ |= h.e;
     if (double_rows > 8)  row_mask_ |= h.d;
     if (double_rows > 4)  row_mask_ |= h.c;
     if (double_rows > 2)  row_mask_ |= h.b;
     row_mask_ |= h.a;
     for (int i = 0; i < double_rows; ++i) {
-      // To avoid the bit-fiddle in the critical path, utilize
-      // a lookup-table for all possible rows.
       gpio_bits_t row_address = (i & 0x01) ? h.a : 0;
       row_address |= (i & 0x02) ? h.b : 0;
       row_address |= (i & 0x04) ? h.c : 0;
       row_address |= (i & 0x08) ? h.d : 0;
       row_address |= (i & 0x10) ? h.e : 0;
-      row_lookup_[i] = row_address;
+      AddMaskedStep(&full_[i], row_address, row_mask_);
     }
   }
-
-  virtual gpio_bits_t need_bits() const { return row_mask_; }
-
-  virtual void SetRowAddress(GPIO *io, int row) {
-    if (row == last_row_) return;
-    io->WriteMaskedBits(row_lookup_[row], row_mask_);
-    last_row_ = row;
-  }
-
-private:
-  gpio_bits_t row_mask_;
-  gpio_bits_t row_lookup_[32];
-  int last_row_;
 };
 
 // The SM5266RowAddressSetter (ABC Shifter + DE direct) sets bits ABC using
@@ -119,124 +394,117 @@ private:
 // same time (if they have the same content), but that isn't implemented here.
 // BK, DIN and DCK are the designations on the SM5266P datasheet.
 // BK = Enable Input, DIN = Serial In, DCK = Clock
-class SM5266RowAddressSetter : public RowAddressSetter {
+//
+// Within a group of 8 rows, the next row is reached by shifting in a
+// single low bit, which moves the enabled bit one up.
+class SM5266RowAddressSetter : public SequenceRowAddressSetter {
 public:
   SM5266RowAddressSetter(int double_rows, const HardwareMapping &h)
-    : row_mask_(h.a | h.b | h.c),
-      last_row_(-1),
-      bk_(h.c),
-      din_(h.b),
-      dck_(h.a) {
-    assert(double_rows <= 32); // designed for up to 1/32 panel
+    : SequenceRowAddressSetter(double_rows, h.a | h.b | h.c) {
+    const gpio_bits_t bk = h.c;
+    const gpio_bits_t din = h.b;
+    const gpio_bits_t dck = h.a;
     if (double_rows > 8)  row_mask_ |= h.d;
     if (double_rows > 16) row_mask_ |= h.e;
     for (int i = 0; i < double_rows; ++i) {
       gpio_bits_t row_address = 0;
       row_address |= (i & 0x08) ? h.d : 0;
       row_address |= (i & 0x10) ? h.e : 0;
-      row_lookup_[i] = row_address;
-    }
-  }
-
-  virtual gpio_bits_t need_bits() const { return row_mask_; }
 
-  virtual void SetRowAddress(GPIO *io, int row) {
-    if (row == last_row_) return;
-    io->SetBits(bk_);  // Enable serial input for the shifter
-    for (int r = 7; r >= 0; r--) {
-      if (row % 8 == r) {
-        io->SetBits(din_);
-      } else {
-        io->ClearBits(din_);
+      AddStep(&full_[i], 0, bk);  // Enable serial input for the shifter
+      for (int r = 7; r >= 0; r--) {
+        AddShiftBit(&full_[i], din, dck, i % 8 == r);
+      }
+      // Disable serial input to keep unwanted bits out of the shifters and
+      // set bits D and E to enable the proper shifter to display the
+      // selected row.
+      AddMaskedStep(&full_[i], row_address, row_mask_);
+
+      if (i % 8 != 0) {
+        AddStep(&next_[i], 0, bk);
+        AddShiftBit(&next_[i], din, dck, false);
+        AddMaskedStep(&next_[i], row_address, row_mask_);
       }
-      io->SetBits(dck_);
-      io->SetBits(dck_);  // Longer clock time; tested with Pi3
-      io->ClearBits(dck_);
     }
-    io->ClearBits(bk_);  // Disable serial input to keep unwanted bits out of the shifters
-    last_row_ = row;
-    // Set bits D and E to enable the proper shifter to display the selected
-    // row.
-    io->WriteMaskedBits(row_lookup_[row], row_mask_);
   }
 
 private:
-  gpio_bits_t row_mask_;
-  int last_row_;
-  const gpio_bits_t bk_;
-  const gpio_bits_t din_;
-  const gpio_bits_t dck_;
-  gpio_bits_t row_lookup_[32];
+  static void AddShiftBit(Sequence *seq, gpio_bits_t din, gpio_bits_t dck,
+                          bool bit) {
+    AddMaskedStep(seq, bit ? din : 0, din);
+    AddStep(seq, 0, dck);
+    AddStep(seq, 0, dck);  // Longer clock time; tested with Pi3
+    AddStep(seq, dck, 0);
+  }
 };
 
-class ShiftRegisterRowAddressSetter : public RowAddressSetter {
+// Shift register with the data on B and the clock on A. The row is
+// selected by shifting a low bit to its position, all others high.
+//
+// The full sequence leaves the shift register one bit ahead of the outputs,
+// so the next row is reached with a single clock shifting in a high bit.
+// That is only true if the last bit shifted in was high, i.e. not after
+// row 0.
+class ShiftRegisterRowAddressSetter : public SequenceRowAddressSetter {
 public:
   ShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
-    : double_rows_(double_rows),
-      row_mask_(h.a | h.b), clock_(h.a), data_(h.b),
-      last_row_(-1) {
-  }
-  virtual gpio_bits_t need_bits() const { return row_mask_; }
+    : SequenceRowAddressSetter(double_rows, h.a | h.b) {
+    const gpio_bits_t clock = h.a;
+    const gpio_bits_t data = h.b;
+    for (int i = 0; i < double_rows; ++i) {
+      for (int activate = 0; activate < double_rows; ++activate) {
+        // Clock low and data in one step; data is taken on the rising edge.
+        const bool is_row = (activate == double_rows - 1 - i);
+        AddMaskedStep(&full_[i], is_row ? 0 : data, clock | data);
+        AddStep(&full_[i], 0, clock);
+      }
+      AddStep(&full_[i], clock, 0);
+      AddStep(&full_[i], 0, clock);
 
-  virtual void SetRowAddress(GPIO *io, int row) {
-    if (row == last_row_) return;
-    for (int activate = 0; activate < double_rows_; ++activate) {
-      io->ClearBits(clock_);
-      if (activate == double_rows_ - 1 - row) {
-        io->ClearBits(data_);
-      } else {
-        io->SetBits(data_);
+      if (i >= 2) {
+        AddMaskedStep(&next_[i], data, clock | data);
+        AddStep(&next_[i], 0, clock);
       }
-      io->SetBits(clock_);
     }
-    io->ClearBits(clock_);
-    io->SetBits(clock_);
-    last_row_ = row;
   }
-
-private:
-  const int double_rows_;
-  const gpio_bits_t row_mask_;
-  const gpio_bits_t clock_;
-  const gpio_bits_t data_;
-  int last_row_;
 };
 
 // Issue #823
 // An shift register row address setter that does not use B but C for the
-// data. Clock is inverted.
-class ABCShiftRegisterRowAddressSetter : public RowAddressSetter {
+// data. Clock is inverted. The row is selected by a single high bit, so the
+// next row is reached by shifting in one low bit.
+//
+// As the clock is inverted, data is never changed in the same step as the
+// clock.
+class ABCShiftRegisterRowAddressSetter : public SequenceRowAddressSetter {
 public:
   ABCShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
-    : double_rows_(double_rows),
-      row_mask_(h.a | h.c),
-      clock_(h.a),
-      data_(h.c),
-      last_row_(-1) {
-  }
-  virtual gpio_bits_t need_bits() const { return row_mask_; }
+    : SequenceRowAddressSetter(double_rows, h.a | h.c) {
+    const gpio_bits_t clock = h.a;
+    const gpio_bits_t data = h.c;
+    for (int i = 0; i < double_rows; ++i) {
+      for (int activate = 0; activate < double_rows; ++activate) {
+        AddShiftBit(&full_[i], clock, data,
+                    activate == double_rows - 1 - i);
+      }
+      AddStep(&full_[i], 0, clock);
+      AddStep(&full_[i], clock, 0);
 
-  virtual void SetRowAddress(GPIO *io, int row) {
-    for (int activate = 0; activate < double_rows_; ++activate) {
-      io->ClearBits(clock_);
-      if (activate == double_rows_ - 1 - row) {
-        io->SetBits(data_);
-      } else {
-        io->ClearBits(data_);
+      if (i >= 1) {
+        AddShiftBit(&next_[i], clock, data, false);
+        AddStep(&next_[i], 0, clock);
+        AddStep(&next_[i], clock, 0);
       }
-      io->SetBits(clock_);
     }
-    io->SetBits(clock_);
-    io->ClearBits(clock_);
-    last_row_ = row;
   }
 
 private:
-  const int double_rows_;
-  const gpio_bits_t row_mask_;
-  const gpio_bits_t clock_;
-  const gpio_bits_t data_;
-  int last_row_;
+  static void AddShiftBit(Sequence *seq, gpio_bits_t clock, gpio_bits_t data,
+                          bool bit) {
+    AddStep(seq, clock, 0);
+    AddMaskedStep(seq, bit ? data : 0, data);
+    AddStep(seq, 0, clock);
+  }
 };
 
 // The DirectABCDRowAddressSetter sets the address by one of
@@ -250,56 +518,87 @@ private:
 // Line B  | 1 | 0 | 1 | 1
 // Line C  | 1 | 1 | 0 | 1
 // Line D  | 1 | 1 | 1 | 0
-class DirectABCDLineRowAddressSetter : public RowAddressSetter {
+class DirectABCDLineRowAddressSetter : public SequenceRowAddressSetter {
 public:
   DirectABCDLineRowAddressSetter(int double_rows, const HardwareMapping &h)
-    : last_row_(-1) {
-	row_mask_ = h.a | h.b | h.c | h.d;
-
-	row_lines_[0] = /*h.a |*/ h.b | h.c | h.d;
-	row_lines_[1] = h.a /*| h.b*/ | h.c | h.d;
-	row_lines_[2] = h.a | h.b /*| h.c */| h.d;
-	row_lines_[3] = h.a | h.b | h.c /*| h.d*/;
+    : SequenceRowAddressSetter(double_rows, h.a | h.b | h.c | h.d) {
+    const gpio_bits_t row_lines[4] = {
+      /*h.a |*/ h.b | h.c | h.d,
+      h.a /*| h.b*/ | h.c | h.d,
+      h.a | h.b /*| h.c */| h.d,
+      h.a | h.b | h.c /*| h.d*/,
+    };
+    for (int i = 0; i < double_rows; ++i) {
+      AddMaskedStep(&full_[i], row_lines[i % 4], row_mask_);
+    }
   }
+};
 
-  virtual gpio_bits_t need_bits() const { return row_mask_; }
-
-  virtual void SetRowAddress(GPIO *io, int row) {
-    if (row == last_row_) return;
-
-    gpio_bits_t row_address = row_lines_[row % 4];
+}  // namespace
 
-    io->WriteMaskedBits(row_address, row_mask_);
-    last_row_ = row;
+RowAddressSetter *CreateRowAddressSetter(int row_address_type,
+                                         int double_rows,
+                                         const HardwareMapping &h) {
+  switch (row_address_type) {
+  case 0: return new DirectRowAddressSetter(double_rows, h);
+  case 1: return new ShiftRegisterRowAddressSetter(double_rows, h);
+  case 2: return new DirectABCDLineRowAddressSetter(double_rows, h);
+  case 3: return new ABCShiftRegisterRowAddressSetter(double_rows, h);
+  case 4: return new SM5266RowAddressSetter(double_rows, h);
   }
-
-private:
-  gpio_bits_t row_lines_[4];
-  gpio_bits_t row_mask_;
-  int last_row_;
-};
-
+  return NULL;
 }
 
 const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
 RowAddressSetter *Framebuffer::row_setter_ = NULL;
 
+// All color bits that are in use with the given number of parallel chains.
+static gpio_bits_t GetUsedColorBits(const HardwareMapping &h, int parallel) {
+  gpio_bits_t result = 0;
+  result |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
+  if (parallel >= 2) {
+    result |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
+  }
+  if (parallel >= 3) {
+    result |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+  }
+  if (parallel >= 4) {
+    result |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
+  }
+  if (parallel >= 5) {
+    result |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
+  }
+  if (parallel >= 6) {
+    result |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+  }
+  return result;
+}
+
+static inline int CountBits(gpio_bits_t bits) {
+  return (sizeof(bits) > sizeof(unsigned int))
+    ? __builtin_popcountll(bits)
+    : __builtin_popcount(bits);
+}
+
 Framebuffer::Framebuffer(int rows, int columns, int parallel,
                          int scan_mode,
                          const char *led_sequence, bool inverse_color,
-                         PixelDesignatorMap **mapper)
+                         const std::shared_ptr<PixelDesignatorMap> &mapper)
   : rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
     scan_mode_(scan_mode),
     inverse_color_(inverse_color),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
+    pwm_bits_(kBitPlanes), do_luminance_correct_(true),
+    dither_pattern_(NULL), dither_offset_(0), brightness_(100),
+    power_load_(0), estimate_row_(0), estimate_on_(0),
     double_rows_(rows / SUB_PANELS_),
     buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
-    shared_mapper_(mapper) {
+    owned_buffer_(new gpio_bits_t[double_rows_ * columns_ * kBitPlanes]),
+    track_damage_(false), full_damage_(false),
+    mapper_(mapper), has_pending_mapper_(false), tables_brightness_(0), tables_luminance_correct_(false) {
   assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
-  assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
   assert(rows_ >=4 && rows_ <= 64 && rows_ % 2 == 0);
   if (parallel > hardware_mapping_->max_parallel_chains) {
     fprintf(stderr, "The %s GPIO mapping only supports %d parallel chain%s, "
@@ -310,41 +609,38 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   }
   assert(parallel >= 1 && parallel <= 6);
 
-  bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  bitplane_buffer_ = owned_buffer_;
 
-  // If we're the first Framebuffer created, the shared PixelMapper is
-  // still NULL, so create one.
+  // If we're the first Framebuffer created, there is no PixelMapper to
+  // share yet, so create one.
   // The first PixelMapper represents the physical layout of a standard matrix
   // with the specific knowledge of the framebuffer, setting up PixelDesignators
   // in a way that they are useful for this Framebuffer.
   //
   // Newly created PixelMappers then can just re-arrange PixelDesignators
   // from the parent PixelMapper opaquely without having to know the details.
-  if (*shared_mapper_ == NULL) {
+  if (mapper_ == NULL) {
     // Gather all the bits for given color for fast Fill()s and use the right
     // bits according to the led sequence
     const struct HardwareMapping &h = *hardware_mapping_;
     gpio_bits_t r = h.p0_r1 | h.p0_r2 | h.p1_r1 | h.p1_r2 | h.p2_r1 | h.p2_r2 | h.p3_r1 | h.p3_r2 | h.p4_r1 | h.p4_r2 | h.p5_r1 | h.p5_r2;
     gpio_bits_t g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2 | h.p3_g1 | h.p3_g2 | h.p4_g1 | h.p4_g2 | h.p5_g1 | h.p5_g2;
     gpio_bits_t b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2 | h.p3_b1 | h.p3_b2 | h.p4_b1 | h.p4_b2 | h.p5_b1 | h.p5_b2;
-    PixelDesignator fill_bits;
+    ColorBits fill_bits;
     fill_bits.r_bit = GetGpioFromLedSequence('R', led_sequence, r, g, b);
     fill_bits.g_bit = GetGpioFromLedSequence('G', led_sequence, r, g, b);
     fill_bits.b_bit = GetGpioFromLedSequence('B', led_sequence, r, g, b);
 
-    *shared_mapper_ = new PixelDesignatorMap(columns_, height_, fill_bits);
-    for (int y = 0; y < height_; ++y) {
-      for (int x = 0; x < columns_; ++x) {
-        InitDefaultDesignator(x, y, led_sequence, (*shared_mapper_)->get(x, y));
-      }
-    }
+    mapper_.reset(new PixelDesignatorMap(columns_, height_, fill_bits));
+    InitDefaultDesignators(led_sequence, mapper_.get());
+    mapper_->ComputeRuns();
   }
 
   Clear();
 }
 
 Framebuffer::~Framebuffer() {
-  delete [] bitplane_buffer_;
+  delete [] owned_buffer_;
 }
 
 // TODO: this should also be parsed from some special formatted string, e.g.
@@ -424,25 +720,8 @@ Framebuffer::~Framebuffer() {
   }
 
   const int double_rows = rows / SUB_PANELS_;
-  switch (row_address_type) {
-  case 0:
-    row_setter_ = new DirectRowAddressSetter(double_rows, h);
-    break;
-  case 1:
-    row_setter_ = new ShiftRegisterRowAddressSetter(double_rows, h);
-    break;
-  case 2:
-    row_setter_ = new DirectABCDLineRowAddressSetter(double_rows, h);
-    break;
-  case 3:
-    row_setter_ = new ABCShiftRegisterRowAddressSetter(double_rows, h);
-    break;
-  case 4:
-    row_setter_ = new SM5266RowAddressSetter(double_rows, h);
-    break;
-  default:
-    assert(0);  // unexpected type.
-  }
+  row_setter_ = CreateRowAddressSetter(row_address_type, double_rows, h);
+  assert(row_setter_ != NULL);  // unexpected type.
 
   all_used_bits |= row_setter_->need_bits();
 
@@ -458,6 +737,7 @@ Framebuffer::~Framebuffer() {
   uint32_t timing_ns = pwm_lsb_nanoseconds;
   for (int b = 0; b < kBitPlanes; ++b) {
     bitplane_timings.push_back(timing_ns);
+    sBitplaneWeights[b] = timing_ns;
     if (b >= dither_bits) timing_ns *= 2;
   }
   sOutputEnablePulser = PinPulser::Create(io, h.output_enable,
@@ -580,10 +860,12 @@ inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
 }
 
 void Framebuffer::Clear() {
+  AddFullDamage();
   if (inverse_color_) {
     Fill(0, 0, 0);
   } else  {
     // Cheaper.
+    UseOwnBuffer(false);
     memset(bitplane_buffer_, 0,
            sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
   }
@@ -613,6 +895,76 @@ static inline uint16_t CIEMapColor(uint8_t brightness, uint8_t c) {
   return luminance_lookup[brightness - 1].color[c];
 }
 
+/* static */ void Framebuffer::SetHardwareBrightness(uint8_t brightness) {
+  if (brightness > 100) brightness = 100;
+  if (brightness < 1) brightness = 1;
+  // Same CIE1931 curve as used for colors, so that the brightness percent
+  // looks the same as with the software brightness.
+  const float v = brightness;
+  sRequestedPulseScale = (v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3);
+}
+
+/* static */ void Framebuffer::SetPowerLimit(float max_load) {
+  sPowerLimit = max_load;
+}
+
+/* static */ float Framebuffer::power_limit_scale() {
+  return sAppliedPulseScale / sRequestedPulseScale;
+}
+
+uint64_t Framebuffer::WeightedOnBits(int first_row, int end_row) {
+  const gpio_bits_t color_bits = GetUsedColorBits(*hardware_mapping_,
+                                                  parallel_);
+  const uint64_t bits_per_plane = (uint64_t)CountBits(color_bits)
+    * (end_row - first_row) * columns_;
+  uint64_t weighted_on = 0;
+  // Note: with pwm dither bits, the lowest planes are not shown in every
+  // refresh. We count them fully, so we err on the safe side.
+  for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
+    uint64_t on = 0;
+    for (int row = first_row; row < end_row; ++row) {
+      const gpio_bits_t *row_data = ValueAt(row, 0, b);
+      for (int col = 0; col < columns_; ++col) {
+        on += CountBits(row_data[col] & color_bits);
+      }
+    }
+    if (inverse_color_) on = bits_per_plane - on;
+    weighted_on += on * sBitplaneWeights[b];
+  }
+  return weighted_on;
+}
+
+uint64_t Framebuffer::WeightedTotalBits() const {
+  const gpio_bits_t color_bits = GetUsedColorBits(*hardware_mapping_,
+                                                  parallel_);
+  const uint64_t bits_per_plane = (uint64_t)CountBits(color_bits)
+    * double_rows_ * columns_;
+  uint64_t weighted_total = 0;
+  for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
+    weighted_total += bits_per_plane * sBitplaneWeights[b];
+  }
+  return weighted_total;
+}
+
+float Framebuffer::EstimatePowerLoad() {
+  const uint64_t weighted_total = WeightedTotalBits();
+  const float load = weighted_total
+    ? (float)WeightedOnBits(0, double_rows_) / weighted_total : 0;
+  power_load_ = load;
+  return load;
+}
+
+void Framebuffer::ContinuePowerEstimate(int rows) {
+  const int end_row = std::min(estimate_row_ + rows, (int)double_rows_);
+  estimate_on_ += WeightedOnBits(estimate_row_, end_row);
+  estimate_row_ = end_row;
+  if (estimate_row_ < double_rows_) return;
+  const uint64_t weighted_total = WeightedTotalBits();
+  power_load_ = weighted_total ? (float)estimate_on_ / weighted_total : 0;
+  estimate_row_ = 0;
+  estimate_on_ = 0;
+}
+
 // Non luminance correction. TODO: consider getting rid of this.
 static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
   // simple scale down the color value
@@ -623,8 +975,169 @@ static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
   return (shift > 0) ? (c << shift) : (c >> -shift);
 }
 
+// Size of the dither patterns, which are tiled over the display.
+static constexpr int kDitherSize = 32;
+
+// Ordered dithering with the 8x8 Bayer matrix.
+static const uint8_t *CreateBayerPattern() {
+  uint8_t *pattern = new uint8_t[kDitherSize * kDitherSize];
+  for (int y = 0; y < kDitherSize; ++y) {
+    for (int x = 0; x < kDitherSize; ++x) {
+      // Bit-reversed interleave of x ^ y and y.
+      int value = 0;
+      for (int bit = 0; bit < 3; ++bit) {
+        value = (value << 2) | (((x ^ y) >> bit) & 1) << 1 | ((y >> bit) & 1);
+      }
+      pattern[y * kDitherSize + x] = value * 4;
+    }
+  }
+  return pattern;
+}
+
+// Points of a binary pattern on a torus with the sum of the gaussian
+// distances to all set points, for the void-and-cluster method.
+class VoidAndCluster {
+public:
+  VoidAndCluster() : is_set_(kCells, false), energy_(kCells, 0) {
+    const float sigma = 1.5;
+    for (int y = 0; y < kDitherSize; ++y) {
+      for (int x = 0; x < kDitherSize; ++x) {
+        const int dx = std::min(x, kDitherSize - x);
+        const int dy = std::min(y, kDitherSize - y);
+        kernel_[y * kDitherSize + x] = expf(-(dx*dx + dy*dy)
+                                            / (2 * sigma * sigma));
+      }
+    }
+  }
+
+  static constexpr int kCells = kDitherSize * kDitherSize;
+
+  bool is_set(int i) const { return is_set_[i]; }
+  void Toggle(int i) {
+    is_set_[i] = !is_set_[i];
+    const float sign = is_set_[i] ? 1 : -1;
+    const int ix = i % kDitherSize, iy = i / kDitherSize;
+    for (int y = 0; y < kDitherSize; ++y) {
+      const float *k = kernel_ + ((y - iy) & (kDitherSize - 1)) * kDitherSize;
+      for (int x = 0; x < kDitherSize; ++x) {
+        energy_[y * kDitherSize + x] += sign * k[(x - ix) & (kDitherSize - 1)];
+      }
+    }
+  }
+
+  // The set point with the most set neighbors.
+  int TightestCluster() const { return Find(true); }
+  // The unset point farthest from all set points.
+  int LargestVoid() const { return Find(false); }
+
+private:
+  int Find(bool set) const {
+    int best = -1;
+    for (int i = 0; i < kCells; ++i) {
+      if (is_set_[i] != set) continue;
+      if (best < 0 || (set ? energy_[i] > energy_[best]
+                       : energy_[i] < energy_[best])) {
+        best = i;
+      }
+    }
+    return best;
+  }
+
+  float kernel_[kCells];
+  std::vector<bool> is_set_;
+  std::vector<float> energy_;
+};
+
+// Blue noise: thresholds without low-frequency structure, generated with
+// the void-and-cluster method (Ulichney 1993).
+static const uint8_t *CreateBlueNoisePattern() {
+  const int cells = VoidAndCluster::kCells;
+  VoidAndCluster initial;
+  uint32_t random = 1;
+  for (int placed = 0; placed < cells / 10; /**/) {
+    random = random * 1103515245 + 12345;
+    const int i = (random >> 8) % cells;
+    if (!initial.is_set(i)) {
+      initial.Toggle(i);
+      ++placed;
+    }
+  }
+  // Even out the initial points: move the tightest cluster into the largest
+  // void until that is where it came from.
+  for (;;) {
+    const int cluster = initial.TightestCluster();
+    initial.Toggle(cluster);
+    const int largest_void = initial.LargestVoid();
+    initial.Toggle(largest_void);
+    if (largest_void == cluster) break;
+  }
+
+  std::vector<int> rank(cells);
+  int initial_count = 0;
+  for (int i = 0; i < cells; ++i) initial_count += initial.is_set(i);
+  // Rank the initial points by removing the tightest clusters first ...
+  VoidAndCluster pattern = initial;
+  for (int r = initial_count - 1; r >= 0; --r) {
+    const int cluster = pattern.TightestCluster();
+    pattern.Toggle(cluster);
+    rank[cluster] = r;
+  }
+  // ... and all others by filling the largest voids.
+  pattern = initial;
+  for (int r = initial_count; r < cells; ++r) {
+    const int largest_void = pattern.LargestVoid();
+    pattern.Toggle(largest_void);
+    rank[largest_void] = r;
+  }
+
+  uint8_t *result = new uint8_t[cells];
+  for (int i = 0; i < cells; ++i) result[i] = rank[i] * 256 / cells;
+  return result;
+}
+
+void Framebuffer::SetDither(DitherMode mode) {
+  switch (mode) {
+  case kNoDither:
+    dither_pattern_ = NULL;
+    break;
+  case kBayerDither: {
+    static const uint8_t *const bayer = CreateBayerPattern();
+    dither_pattern_ = bayer;
+    break;
+  }
+  case kBlueNoiseDither: {
+    static const uint8_t *const blue_noise = CreateBlueNoisePattern();
+    dither_pattern_ = blue_noise;
+    break;
+  }
+  }
+}
+
+/* static */ bool Framebuffer::DitherModeFromName(const char *name,
+                                                  DitherMode *mode) {
+  if (name == NULL || *name == '\0' || strcasecmp(name, "none") == 0) {
+    *mode = kNoDither;
+  } else if (strcasecmp(name, "bayer") == 0) {
+    *mode = kBayerDither;
+  } else if (strcasecmp(name, "blue-noise") == 0) {
+    *mode = kBlueNoiseDither;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline uint16_t Framebuffer::DitherAt(int x, int y) const {
+  if (dither_pattern_ == NULL) return 0;
+  const uint8_t threshold = dither_offset_
+    + dither_pattern_[(y & (kDitherSize - 1)) * kDitherSize
+                      + (x & (kDitherSize - 1))];
+  // Scaled to the bits that are cut off.
+  return ((uint32_t)threshold << (kBitPlanes - pwm_bits_)) >> 8;
+}
+
 inline void Framebuffer::MapColors(
-  uint8_t r, uint8_t g, uint8_t b,
+  uint8_t r, uint8_t g, uint8_t b, uint16_t dither,
   uint16_t *red, uint16_t *green, uint16_t *blue) {
 
   if (do_luminance_correct_) {
@@ -637,6 +1150,98 @@ inline void Framebuffer::MapColors(
     *blue  = DirectMapColor(brightness_, b);
   }
 
+  if (dither) {
+    constexpr uint16_t kMax = (1 << kBitPlanes) - 1;
+    *red   = std::min<uint16_t>(*red + dither, kMax);
+    *green = std::min<uint16_t>(*green + dither, kMax);
+    *blue  = std::min<uint16_t>(*blue + dither, kMax);
+  }
+
+  if (inverse_color_) {
+    *red = ~(*red);
+    *green = ~(*green);
+    *blue = ~(*blue);
+  }
+}
+
+// Color bits of a pixel in the bitplane "plane" without branches.
+static inline gpio_bits_t PlaneBits(uint16_t red, uint16_t green,
+                                    uint16_t blue, int plane,
+                                    const ColorBits &bits) {
+  return ((bits.r_bit & -(gpio_bits_t)((red >> plane) & 1))
+          | (bits.g_bit & -(gpio_bits_t)((green >> plane) & 1))
+          | (bits.b_bit & -(gpio_bits_t)((blue >> plane) & 1)));
+}
+
+// Light output of the color value "c" (fractional after a gamma) in
+// bitplane units. For integers the same as CIEMapColor() and
+// DirectMapColor() give.
+static float OutputLevel(float c, uint8_t brightness, bool luminance_correct) {
+  if (luminance_correct) {
+    float out_factor = ((1 << internal::Framebuffer::kBitPlanes) - 1);
+    float v = c * brightness / 255.0;
+    return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
+  }
+  return ldexpf(floorf(c * brightness / 100),
+                internal::Framebuffer::kBitPlanes - 8);
+}
+
+void Framebuffer::BuildCalibrationTables() {
+  tables_source_ = mapper_->calibrations();
+  tables_brightness_ = brightness_;
+  tables_luminance_correct_ = do_luminance_correct_;
+  calibration_tables_.resize(tables_source_ ? tables_source_->size() : 0);
+  for (size_t k = 0; k < calibration_tables_.size(); ++k) {
+    const ColorCalibration &c = (*tables_source_)[k];
+    CalibrationTable &table = calibration_tables_[k];
+    table.diagonal = true;
+    for (int in = 0; in < 3; ++in) {
+      float level[256];
+      for (int v = 0; v < 256; ++v) {
+        const float corrected = (c.gamma[in] == 1.0f)
+          ? v : 255 * powf(v / 255.0f, c.gamma[in]);
+        level[v] = OutputLevel(corrected, brightness_, do_luminance_correct_);
+      }
+      for (int out = 0; out < 3; ++out) {
+        const float factor = c.matrix[out][in];
+        if (out != in && factor != 0) table.diagonal = false;
+        for (int v = 0; v < 256; ++v) {
+          table.value[out][in][v] = roundf(factor * level[v]);
+        }
+      }
+    }
+  }
+}
+
+inline const Framebuffer::CalibrationTable *
+Framebuffer::GetCalibrationTables() {
+  if (tables_source_ != mapper_->calibrations()
+      || tables_brightness_ != brightness_
+      || tables_luminance_correct_ != do_luminance_correct_) {
+    BuildCalibrationTables();
+  }
+  return calibration_tables_.data();
+}
+
+inline void Framebuffer::MapCalibratedColors(
+  const CalibrationTable &table, uint8_t r, uint8_t g, uint8_t b,
+  uint16_t dither, uint16_t *red, uint16_t *green, uint16_t *blue) {
+  int32_t out[3];
+  if (table.diagonal) {
+    out[0] = table.value[0][0][r];
+    out[1] = table.value[1][1][g];
+    out[2] = table.value[2][2][b];
+  } else {
+    for (int i = 0; i < 3; ++i) {
+      out[i] = table.value[i][0][r] + table.value[i][1][g]
+        + table.value[i][2][b];
+    }
+  }
+  constexpr int32_t kMax = (1 << kBitPlanes) - 1;
+  *red   = std::min(std::max(out[0] + dither, 0), kMax);
+  *green = std::min(std::max(out[1] + dither, 0), kMax);
+  *blue  = std::min(std::max(out[2] + dither, 0), kMax);
+
   if (inverse_color_) {
     *red = ~(*red);
     *green = ~(*green);
@@ -646,9 +1251,11 @@ inline void Framebuffer::MapColors(
 
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
   uint16_t red, green, blue;
-  MapColors(r, g, b, &red, &green, &blue);
-  const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
+  MapColors(r, g, b, 0, &red, &green, &blue);
+  const ColorBits &fill = mapper_->GetFillColorBits();
 
+  AddFullDamage();
+  UseOwnBuffer(true);  // Planes below pwm_bits_ are not touched.
   for (int bits = kBitPlanes - pwm_bits_; bits < kBitPlanes; ++bits) {
     uint16_t mask = 1 << bits;
     gpio_bits_t plane_bits = 0;
@@ -663,27 +1270,67 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
       }
     }
   }
+
+  if (mapper_->calibrations() == NULL && dither_pattern_ == NULL) return;
+  // Calibrated panels and dithering need the color of each pixel.
+  const CalibrationTable *tables = GetCalibrationTables();
+  const PixelDesignatorMap &map = *mapper_;
+  for (int y = 0; y < map.height(); ++y) {
+    int run_count;
+    const PixelRun *run = map.GetRowRuns(y, &run_count);
+    for (/**/; run_count > 0; --run_count, ++run) {
+      const ColorBits &color_bits = map.color_bits(run->color_bits);
+      const CalibrationTable *calibration = (color_bits.calibration < 0)
+        ? NULL
+        : tables + color_bits.calibration;
+      if (calibration == NULL && dither_pattern_ == NULL) continue;
+      gpio_bits_t *pos = bitplane_buffer_ + run->gpio_word;
+      for (int i = 0; i < run->length; ++i, pos += run->stride) {
+        const uint16_t dither = DitherAt(run->x + i, y);
+        if (calibration == NULL) {
+          MapColors(r, g, b, dither, &red, &green, &blue);
+        } else {
+          MapCalibratedColors(*calibration, r, g, b, dither,
+                              &red, &green, &blue);
+        }
+        gpio_bits_t *bits = pos + columns_ * (kBitPlanes - pwm_bits_);
+        for (int plane = kBitPlanes - pwm_bits_; plane < kBitPlanes; ++plane) {
+          *bits = (*bits & color_bits.mask)
+            | PlaneBits(red, green, blue, plane, color_bits);
+          bits += columns_;
+        }
+      }
+    }
+  }
 }
 
-int Framebuffer::width() const { return (*shared_mapper_)->width(); }
-int Framebuffer::height() const { return (*shared_mapper_)->height(); }
+int Framebuffer::width() const { return mapper_->width(); }
+int Framebuffer::height() const { return mapper_->height(); }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
+  PixelDesignatorMap *const map = mapper_.get();
+  const PixelDesignator *designator = map->get(x, y);
   if (designator == NULL) return;
-  const long pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
+  const uint32_t pos = designator->gpio_word;
+  if (pos == PixelDesignator::kUnused) return;
+  const ColorBits &color_bits = map->color_bits(designator->color_bits);
 
   uint16_t red, green, blue;
-  MapColors(r, g, b, &red, &green, &blue);
+  if (color_bits.calibration < 0) {
+    MapColors(r, g, b, DitherAt(x, y), &red, &green, &blue);
+  } else {
+    MapCalibratedColors(GetCalibrationTables()[color_bits.calibration],
+                        r, g, b, DitherAt(x, y), &red, &green, &blue);
+  }
 
+  UseOwnBuffer(true);
   gpio_bits_t *bits = bitplane_buffer_ + pos;
   const int min_bit_plane = kBitPlanes - pwm_bits_;
   bits += (columns_ * min_bit_plane);
-  const gpio_bits_t r_bits = designator->r_bit;
-  const gpio_bits_t g_bits = designator->g_bit;
-  const gpio_bits_t b_bits = designator->b_bit;
-  const gpio_bits_t designator_mask = designator->mask;
+  const gpio_bits_t r_bits = color_bits.r_bit;
+  const gpio_bits_t g_bits = color_bits.g_bit;
+  const gpio_bits_t b_bits = color_bits.b_bit;
+  const gpio_bits_t designator_mask = color_bits.mask;
   for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
     gpio_bits_t color_bits = 0;
     if (red & mask)   color_bits |= r_bits;
@@ -695,13 +1342,79 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
 }
 
 void Framebuffer::SetPixels(int x, int y, int width, int height, Color *colors) {
-  for (int iy = 0; iy < height; ++iy) {
-    for (int ix = 0; ix < width; ++ix) {
-      SetPixel(x + ix, y + iy, colors->r, colors->g, colors->b);
-      ++colors;
+  const PixelDesignatorMap &map = *mapper_;
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, map.width());
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, map.height());
+  if (x_start >= x_end || y_start >= y_end) return;
+
+  UseOwnBuffer(true);
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+
+  // Colors of a piece of a run, mapped to bitplane values.
+  static constexpr int kChunk = 128;
+  uint16_t red[kChunk], green[kChunk], blue[kChunk];
+  uint16_t dither[kChunk] = {};  // Stays 0 without dithering.
+
+  for (int row = y_start; row < y_end; ++row) {
+    const Color *row_colors = colors + (size_t)(row - y) * width;
+    int run_count;
+    const PixelRun *run = map.GetRowRuns(row, &run_count);
+    for (/**/; run_count > 0; --run_count, ++run) {
+      const int run_start = std::max(run->x, x_start);
+      const int run_end = std::min(run->x + run->length, x_end);
+      const ColorBits color_bits = map.color_bits(run->color_bits);
+      const gpio_bits_t designator_mask = color_bits.mask;
+      const int32_t stride = run->stride;
+      const CalibrationTable *calibration = (color_bits.calibration < 0)
+        ? NULL
+        : GetCalibrationTables() + color_bits.calibration;
+      for (int px = run_start; px < run_end; px += kChunk) {
+        const int n = std::min(run_end - px, kChunk);
+        if (dither_pattern_) {
+          for (int i = 0; i < n; ++i) dither[i] = DitherAt(px + i, row);
+        }
+        if (calibration == NULL && dither_pattern_ == NULL) {
+          for (int i = 0; i < n; ++i) {
+            const Color &c = row_colors[px + i - x];
+            MapColors(c.r, c.g, c.b, 0, &red[i], &green[i], &blue[i]);
+          }
+        } else if (calibration == NULL) {
+          for (int i = 0; i < n; ++i) {
+            const Color &c = row_colors[px + i - x];
+            MapColors(c.r, c.g, c.b, dither[i], &red[i], &green[i], &blue[i]);
+          }
+        } else {
+          for (int i = 0; i < n; ++i) {
+            const Color &c = row_colors[px + i - x];
+            MapCalibratedColors(*calibration, c.r, c.g, c.b, dither[i],
+                                &red[i], &green[i], &blue[i]);
+          }
+        }
+        gpio_bits_t *bits = bitplane_buffer_ + run->gpio_word
+          + (px - run->x) * stride + columns_ * min_bit_plane;
+        // Same as SetPixel(), but one bitplane at a time for all pixels,
+        // which the compiler can vectorize for contiguous runs.
+        for (int b = min_bit_plane; b < kBitPlanes; ++b, bits += columns_) {
+          if (stride == 1) {
+            for (int i = 0; i < n; ++i) {
+              bits[i] = (bits[i] & designator_mask)
+                | PlaneBits(red[i], green[i], blue[i], b, color_bits);
+            }
+          } else {
+            gpio_bits_t *pos = bits;
+            for (int i = 0; i < n; ++i, pos += stride) {
+              *pos = (*pos & designator_mask)
+                | PlaneBits(red[i], green[i], blue[i], b, color_bits);
+            }
+          }
+        }
+      }
     }
   }
 }
+
 // Strange LED-mappings such as RBG or so are handled here.
 gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
                                                 const char *led_sequence,
@@ -723,81 +1436,42 @@ gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
   return default_r;  // String too long, should've been caught earlier.
 }
 
-void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
-                                        PixelDesignator *d) {
+void Framebuffer::InitDefaultDesignators(const char *seq,
+                                         PixelDesignatorMap *map) {
   const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t *bits = ValueAt(y % double_rows_, x, 0);
-  d->gpio_word = bits - bitplane_buffer_;
-  d->r_bit = d->g_bit = d->b_bit = 0;
-  if (y < rows_) {
-    if (y < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r1, h.p0_g1, h.p0_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p0_r2, h.p0_g2, h.p0_b2);
-    }
-  }
-  else if (y >= rows_ && y < 2 * rows_) {
-    if (y - rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r1, h.p1_g1, h.p1_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p1_r2, h.p1_g2, h.p1_b2);
-    }
-  }
-  else if (y >= 2*rows_ && y < 3 * rows_) {
-    if (y - 2*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r1, h.p2_g1, h.p2_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p2_r2, h.p2_g2, h.p2_b2);
-    }
-  }
-  else if (y >= 3*rows_ && y < 4 * rows_) {
-    if (y - 3*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r1, h.p3_g1, h.p3_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p3_r2, h.p3_g2, h.p3_b2);
-    }
-  }
-  else if (y >= 4*rows_ && y < 5 * rows_){
-    if (y - 4*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r1, h.p4_g1, h.p4_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p4_r2, h.p4_g2, h.p4_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p4_r2, h.p4_g2, h.p4_b2);
+  const gpio_bits_t pins[6][2][3] = {
+    { { h.p0_r1, h.p0_g1, h.p0_b1 }, { h.p0_r2, h.p0_g2, h.p0_b2 } },
+    { { h.p1_r1, h.p1_g1, h.p1_b1 }, { h.p1_r2, h.p1_g2, h.p1_b2 } },
+    { { h.p2_r1, h.p2_g1, h.p2_b1 }, { h.p2_r2, h.p2_g2, h.p2_b2 } },
+    { { h.p3_r1, h.p3_g1, h.p3_b1 }, { h.p3_r2, h.p3_g2, h.p3_b2 } },
+    { { h.p4_r1, h.p4_g1, h.p4_b1 }, { h.p4_r2, h.p4_g2, h.p4_b2 } },
+    { { h.p5_r1, h.p5_g1, h.p5_b1 }, { h.p5_r2, h.p5_g2, h.p5_b2 } },
+  };
+
+  // The color bits only depend on the parallel chain and the half of the
+  // panel, so they are resolved once for each of these instead of per pixel.
+  uint32_t color_bits[6][2];
+  for (int p = 0; p < parallel_; ++p) {
+    for (int half = 0; half < SUB_PANELS_; ++half) {
+      const gpio_bits_t *rgb = pins[p][half];
+      ColorBits c;
+      c.r_bit = GetGpioFromLedSequence('R', seq, rgb[0], rgb[1], rgb[2]);
+      c.g_bit = GetGpioFromLedSequence('G', seq, rgb[0], rgb[1], rgb[2]);
+      c.b_bit = GetGpioFromLedSequence('B', seq, rgb[0], rgb[1], rgb[2]);
+      c.mask = ~(c.r_bit | c.g_bit | c.b_bit);
+      color_bits[p][half] = map->AddColorBits(c);
     }
-
   }
-  else {
-    if (y - 5*rows_ < double_rows_) {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r1, h.p5_g1, h.p5_b1);
-    } else {
-      d->r_bit = GetGpioFromLedSequence('R', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->g_bit = GetGpioFromLedSequence('G', seq, h.p5_r2, h.p5_g2, h.p5_b2);
-      d->b_bit = GetGpioFromLedSequence('B', seq, h.p5_r2, h.p5_g2, h.p5_b2);
+
+  for (int y = 0; y < height_; ++y) {
+    const uint32_t row_bits = color_bits[y / rows_][(y % rows_) / double_rows_];
+    const uint32_t row_word = ValueAt(y % double_rows_, 0, 0) - bitplane_buffer_;
+    PixelDesignator *designator = map->get(0, y);
+    for (int x = 0; x < columns_; ++x) {
+      designator[x].gpio_word = row_word + x;
+      designator[x].color_bits = row_bits;
     }
   }
-
-  d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
@@ -805,38 +1479,134 @@ void Framebuffer::Serialize(const char **data, size_t *len) const {
   *len = buffer_size_;
 }
 
+void Framebuffer::SerializeMutable(char **data, size_t *len) {
+  AddFullDamage();
+  UseOwnBuffer(true);
+  *data = reinterpret_cast<char*>(bitplane_buffer_);
+  *len = buffer_size_;
+}
+
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
+  AddFullDamage();
+  UseOwnBuffer(false);
   memcpy(bitplane_buffer_, data, len);
   return true;
 }
 
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
+  AddFullDamage();
+  UseOwnBuffer(false);
   memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
-  color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
-    color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
-  }
-  if (parallel_ >= 3) {
-    color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
+bool Framebuffer::SetExternalBuffer(const char *data, size_t len) {
+  if (len != buffer_size_
+      || reinterpret_cast<uintptr_t>(data) % sizeof(gpio_bits_t) != 0) {
+    return false;
   }
-  if (parallel_ >= 4) {
-    color_clk_mask |= h.p3_r1 | h.p3_g1 | h.p3_b1 | h.p3_r2 | h.p3_g2 | h.p3_b2;
+  AddFullDamage();
+  // Never written to; all modifications go through UseOwnBuffer() first.
+  bitplane_buffer_ = reinterpret_cast<gpio_bits_t*>(const_cast<char*>(data));
+  return true;
+}
+
+void Framebuffer::SwitchToOwnBuffer(bool keep_content) {
+  if (keep_content) memcpy(owned_buffer_, bitplane_buffer_, buffer_size_);
+  bitplane_buffer_ = owned_buffer_;
+}
+
+void Framebuffer::ResetDamage() {
+  full_damage_ = false;
+  const DamageSpan none = { columns_, -1 };
+  damage_.assign(double_rows_, none);
+}
+
+// Both words need to be in the same double row.
+inline void Framebuffer::MarkDamaged(uint32_t first_word, uint32_t last_word) {
+  const uint32_t row_words = columns_ * kBitPlanes;
+  DamageSpan &span = damage_[first_word / row_words];
+  span.first = std::min(span.first, (int)(first_word % row_words));
+  span.last = std::max(span.last, (int)(last_word % row_words));
+}
+
+void Framebuffer::AddDamage(int x, int y, int width, int height) {
+  if (!track_damage_) {
+    track_damage_ = true;
+    ResetDamage();
   }
-  if (parallel_ >= 5) {
-    color_clk_mask |= h.p4_r1 | h.p4_g1 | h.p4_b1 | h.p4_r2 | h.p4_g2 | h.p4_b2;
+  if (full_damage_) return;
+  const PixelDesignatorMap &map = *mapper_;
+  const int x_start = std::max(x, 0);
+  const int x_end = std::min(x + width, map.width());
+  const int y_start = std::max(y, 0);
+  const int y_end = std::min(y + height, map.height());
+  for (int row = y_start; row < y_end; ++row) {
+    int run_count;
+    const PixelRun *run = map.GetRowRuns(row, &run_count);
+    for (/**/; run_count > 0; --run_count, ++run) {
+      const int start = std::max(run->x, x_start);
+      const int end = std::min(run->x + run->length, x_end);
+      if (start >= end) continue;
+      const uint32_t first = run->gpio_word + (start - run->x) * run->stride;
+      if (run->stride == 1) {
+        // Contiguous words never cross into another double row.
+        MarkDamaged(first, first + (end - start) - 1);
+      } else {
+        for (int i = 0; i < end - start; ++i) {
+          const uint32_t word = first + i * run->stride;
+          MarkDamaged(word, word);
+        }
+      }
+    }
   }
-  if (parallel_ >= 6) {
-    color_clk_mask |= h.p5_r1 | h.p5_g1 | h.p5_b1 | h.p5_r2 | h.p5_g2 | h.p5_b2;
+}
+
+void Framebuffer::AddFullDamage() {
+  if (track_damage_) full_damage_ = true;
+}
+
+void Framebuffer::CopyDamageTo(Framebuffer *other) {
+  if (full_damage_ || !track_damage_) {
+    other->CopyFrom(this);
+  } else {
+    other->UseOwnBuffer(true);
+    for (int row = 0; row < double_rows_; ++row) {
+      const DamageSpan &span = damage_[row];
+      if (span.first > span.last) continue;
+      const size_t len = (span.last - span.first + 1) * sizeof(gpio_bits_t);
+      for (int b = 0; b < kBitPlanes; ++b) {
+        memcpy(other->ValueAt(row, span.first, b),
+               ValueAt(row, span.first, b), len);
+      }
+    }
   }
+  other->track_damage_ = true;
+  other->ResetDamage();
+  ResetDamage();
+}
 
-  color_clk_mask |= h.clock;
+void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
+  const struct HardwareMapping &h = *hardware_mapping_;
+  // Mask of bits while clocking in.
+  const gpio_bits_t color_clk_mask = GetUsedColorBits(h, parallel_) | h.clock;
+
+  float pulse_scale = sRequestedPulseScale;
+  const float power_load = power_load_;  // Might be updated meanwhile.
+  if (sPowerLimit > 0 && power_load * pulse_scale > sPowerLimit) {
+    // Reduce in steps, so that the pulse timing (which might involve
+    // re-programming the PWM clock) is not changed on every small change
+    // of content. Rounded down to stay below the limit.
+    const int steps = std::max(1, (int)(kPowerLimitSteps * sPowerLimit
+                                        / (power_load * pulse_scale)));
+    pulse_scale *= (float)steps / kPowerLimitSteps;
+  }
+  if (pulse_scale != sAppliedPulseScale) {
+    sOutputEnablePulser->WaitPulseFinished();
+    sOutputEnablePulser->SetPulseScale(pulse_scale);
+    sAppliedPulseScale = pulse_scale;
+  }
 
   // Depending if we do dithering, we might not always show the lowest bits.
   const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
@@ -20,6 +20,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 /*
  * nanosleep() takes longer than requested because of OS jitter.
  * In about 99.9% of the cases, this is <= 25 microcseconds on
@@ -450,7 +453,8 @@ class TimerBasedPinPulser : public PinPulser {
 public:
   TimerBasedPinPulser(GPIO *io, gpio_bits_t bits,
                       const std::vector<int> &nano_specs)
-    : io_(io), bits_(bits), nano_specs_(nano_specs) {
+    : io_(io), bits_(bits), nano_specs_(nano_specs),
+      scaled_specs_(nano_specs) {
     if (!s_Timer1Mhz) {
       fprintf(stderr, "FYI: not running as root which means we can't properly "
               "control timing unless this is a real-time kernel. Expect color "
@@ -460,21 +464,45 @@ public:
 
   virtual void SendPulse(int time_spec_number) {
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    Timers::sleep_nanos(scaled_specs_[time_spec_number]);
     io_->SetBits(bits_);
   }
 
+  virtual void SetPulseScale(float factor) {
+    for (size_t i = 0; i < nano_specs_.size(); ++i) {
+      scaled_specs_[i] = std::max(1, (int)lroundf(nano_specs_[i] * factor));
+    }
+  }
+
 private:
   GPIO *const io_;
   const gpio_bits_t bits_;
   const std::vector<int> nano_specs_;
+  std::vector<int> scaled_specs_;
 };
 
-// Check that 3 shows up in isolcpus
-static bool HasIsolCPUs() {
+// Check that the given cpu shows up in the isolcpus list. The kernel
+// reports it as comma-separated list of ranges, e.g. "1-2,3".
+static bool IsIsolatedCPU(int cpu) {
   char buf[256];
   ReadTextFileToBuffer(buf, sizeof(buf), "/sys/devices/system/cpu/isolated");
-  return index(buf, '3') != NULL;
+  const char *pos = buf;
+  while (*pos) {
+    char *endptr;
+    const long first = strtol(pos, &endptr, 10);
+    if (endptr == pos) break;
+    long last = first;
+    pos = endptr;
+    if (*pos == '-') {
+      ++pos;
+      last = strtol(pos, &endptr, 10);
+      if (endptr == pos) break;
+      pos = endptr;
+    }
+    if (cpu >= first && cpu <= last) return true;
+    if (*pos == ',') ++pos;
+  }
+  return false;
 }
 
 static void busy_wait_nanos_rpi_1(long nanos);
@@ -517,14 +545,6 @@ bool Timers::Init() {
   }
 
   DisableRealtimeThrottling();
-  // If we have it, we run the update thread on core3. No perf-compromises:
-  WriteTo("/sys/devices/system/cpu/cpu3/cpufreq/scaling_governor",
-          "performance");
-
-  if (GetPiModel() != PI_MODEL_1 && !HasIsolCPUs()) {
-    fprintf(stderr, "Suggestion: to slightly improve display update, add\n\tisolcpus=3\n"
-            "at the end of /boot/cmdline.txt and reboot (see README.md)\n");
-  }
   return true;
 }
 
@@ -662,7 +682,8 @@ public:
   }
 
   HardwarePinPulser(gpio_bits_t pins, const std::vector<int> &specs)
-    : triggered_(false) {
+    : specs_(specs), pwm_range_(specs.size()), sleep_hints_us_(specs.size()),
+      triggered_(false), pwm_divider_(0) {
     assert(CanHandle(pins));
     assert(s_CLK_registers && s_PWM_registers && s_Timer1Mhz);
 
@@ -683,12 +704,6 @@ public:
       exit(1);
     }
 
-    for (size_t i = 0; i < specs.size(); ++i) {
-      // Hints how long to nanosleep, already corrected for system overhead.
-      sleep_hints_us_.push_back(specs[i]/1000 - JitterAllowanceMicroseconds());
-    }
-
-    const int base = specs[0];
     // Get relevant registers
     fifo_ = s_PWM_registers + PWM_FIFO;
 
@@ -701,9 +716,27 @@ public:
     } else {
       assert(false); // should've been caught by CanHandle()
     }
-    InitPWMDivider((base/2) / PWM_BASE_TIME_NS);
-    for (size_t i = 0; i < specs.size(); ++i) {
-      pwm_range_.push_back(2 * specs[i] / base);
+    SetPulseScale(1.0f);
+  }
+
+  // Called in the refresh thread, so this does not allocate, and only
+  // restarts the PWM clock if its divider changes.
+  virtual void SetPulseScale(float factor) {
+    // The shortest pulse determines the PWM clock. If it gets shorter than
+    // what the smallest divider can do, we keep the divider there and only
+    // clamp the lowest bitplanes; all others still keep their exact ratio.
+    const int base = std::max((int)lroundf(specs_[0] * factor),
+                              2 * kMinPWMDivider * PWM_BASE_TIME_NS);
+    const uint32_t divider = (base/2) / PWM_BASE_TIME_NS;
+    if (divider != pwm_divider_) {
+      InitPWMDivider(divider);
+      pwm_divider_ = divider;
+    }
+    for (size_t i = 0; i < specs_.size(); ++i) {
+      const int scaled = lroundf(specs_[i] * factor);
+      // Hints how long to nanosleep, already corrected for system overhead.
+      sleep_hints_us_[i] = scaled/1000 - JitterAllowanceMicroseconds();
+      pwm_range_[i] = std::max(2, 2 * scaled / base);
     }
   }
 
@@ -818,12 +851,17 @@ private:
   }
 
 private:
+  // Smallest PWM clock divider we use; with 500Mhz PLLD this gives 4ns ticks.
+  static constexpr int kMinPWMDivider = 2;
+
+  const std::vector<int> specs_;
   std::vector<uint32_t> pwm_range_;
   std::vector<int> sleep_hints_us_;
   volatile uint32_t *fifo_;
   uint32_t start_time_;
   int sleep_hint_us_;
   bool triggered_;
+  uint32_t pwm_divider_;  // Currently set up; 0 before the first setup.
 };
 
 } // end anonymous namespace
@@ -840,6 +878,23 @@ PinPulser *PinPulser::Create(GPIO *io, gpio_bits_t gpio_mask,
   }
 }
 
+void PrepareRefreshCPU(int cpu) {
+  if (cpu < 0 || cpu >= GetNumCores() || GetNumCores() == 1)
+    return;
+  // We run the update thread on this core. No perf-compromises:
+  char filename[256];
+  snprintf(filename, sizeof(filename),
+           "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+  WriteTo(filename, "performance");
+
+  if (!IsIsolatedCPU(cpu)) {
+    fprintf(stderr, "Suggestion: to slightly improve display update, add\n"
+            "\tisolcpus=%d\n"
+            "at the end of /boot/cmdline.txt and reboot (see README.md)\n",
+            cpu);
+  }
+}
+
 // For external use, e.g. in the matrix for extra time.
 uint32_t GetMicrosecondCounter() {
   if (s_Timer1Mhz) return *s_Timer1Mhz;
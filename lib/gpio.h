@@ -72,6 +72,15 @@ public:
     delay();
   }
 
+  // Clear the bits that are '1' in "clear_bits", then set the bits that are
+  // '1' in "set_bits" with a single delay. Registers with nothing to change
+  // are not written.
+  inline void ClearAndSetBits(gpio_bits_t clear_bits, gpio_bits_t set_bits) {
+    if (clear_bits) WriteClrBits(clear_bits);
+    if (set_bits) WriteSetBits(set_bits);
+    delay();
+  }
+
   inline gpio_bits_t Read() const { return ReadRegisters() & input_bits_; }
 
   // Return if this is appears to be a Pi4
@@ -153,6 +162,13 @@ public:
 
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Scale all pulse lengths by "factor" relative to the nano_wait_spec
+  // given at creation time (1.0 = unchanged). Implementations try to keep
+  // the ratio between the pulses, but very short pulses might be clamped
+  // to what the timing source can do.
+  // Must only be called while no pulse is in flight.
+  virtual void SetPulseScale(float factor) = 0;
 };
 
 // Get rolling over microsecond counter. We get this from a hardware register
@@ -161,6 +177,11 @@ uint32_t GetMicrosecondCounter();
 
 void SleepMicroseconds(long);
 
+// Prepare the given CPU core to run the refresh thread: switch it to the
+// 'performance' governor and suggest isolating it if it is not already.
+// Does nothing on single-core machines or if "cpu" does not exist.
+void PrepareRefreshCPU(int cpu);
+
 }  // end namespace rgb_matrix
 
 #endif  // RPI_GPIO_INGERNALH
@@ -89,6 +89,23 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     OPT_COPY_IF_SET(panel_type);
     OPT_COPY_IF_SET(limit_refresh_rate_hz);
     OPT_COPY_IF_SET(disable_busy_waiting);
+    OPT_COPY_IF_SET(hardware_brightness);
+    OPT_COPY_IF_SET(limit_power_percent);
+    // Zero is a valid choice for these; it is passed in encoded.
+    if (opts->refresh_cpu) {
+      default_opts.refresh_cpu = (opts->refresh_cpu == LED_REFRESH_CPU_0)
+        ? 0 : opts->refresh_cpu;
+    }
+    if (opts->refresh_priority) {
+      default_opts.refresh_priority
+        = (opts->refresh_priority == LED_REFRESH_NOT_REALTIME)
+        ? 0 : opts->refresh_priority;
+    }
+    OPT_COPY_IF_SET(refresh_round_robin);
+    OPT_COPY_IF_SET(lock_memory);
+    OPT_COPY_IF_SET(verbose);
+    OPT_COPY_IF_SET(panel_calibration);
+    OPT_COPY_IF_SET(dither);
 #undef OPT_COPY_IF_SET
   }
 
@@ -136,6 +153,17 @@ static struct RGBLedMatrix *led_matrix_create_from_options_optional_edit(
     ACTUAL_VALUE_BACK_TO_OPT(panel_type);
     ACTUAL_VALUE_BACK_TO_OPT(limit_refresh_rate_hz);
     ACTUAL_VALUE_BACK_TO_OPT(disable_busy_waiting);
+    ACTUAL_VALUE_BACK_TO_OPT(hardware_brightness);
+    ACTUAL_VALUE_BACK_TO_OPT(limit_power_percent);
+    opts->refresh_cpu = (matrix_options.refresh_cpu == 0)
+      ? LED_REFRESH_CPU_0 : matrix_options.refresh_cpu;
+    opts->refresh_priority = (matrix_options.refresh_priority == 0)
+      ? LED_REFRESH_NOT_REALTIME : matrix_options.refresh_priority;
+    ACTUAL_VALUE_BACK_TO_OPT(refresh_round_robin);
+    ACTUAL_VALUE_BACK_TO_OPT(lock_memory);
+    ACTUAL_VALUE_BACK_TO_OPT(verbose);
+    ACTUAL_VALUE_BACK_TO_OPT(panel_calibration);
+    ACTUAL_VALUE_BACK_TO_OPT(dither);
 #undef ACTUAL_VALUE_BACK_TO_OPT
   }
 
@@ -242,6 +270,11 @@ void led_canvas_fill(struct LedCanvas *canvas, uint8_t r, uint8_t g, uint8_t b)
   to_canvas(canvas)->Fill(r, g, b);
 }
 
+void led_canvas_add_damage(struct LedCanvas *canvas, int x, int y,
+                           int width, int height) {
+  to_canvas(canvas)->AddDamage(x, y, width, height);
+}
+
 struct LedFont *load_font(const char *bdf_font_file) {
   rgb_matrix::Font* font = new rgb_matrix::Font();
   font->LoadFont(bdf_font_file);
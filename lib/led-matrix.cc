@@ -24,11 +24,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "gpio.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
@@ -76,6 +82,12 @@ public:
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction);
   bool ApplyPixelMapper(const PixelMapper *mapper);
 
+  // Apply all "mappers" in sequence to the current mapping. All canvases
+  // switch to the result right away.
+  bool ApplyPixelMappers(const std::vector<const PixelMapper*> &mappers);
+
+  bool RemapPixels(const char *pixel_mapper_config);
+
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();   // return the pwm-bits of the currently active buffer.
 
@@ -89,6 +101,10 @@ public:
 
   uint64_t RequestInputs(uint64_t);
   uint64_t AwaitInputChange(int timeout_ms);
+  void SetInputDebounce(uint64_t gpio_bits, int debounce_us);
+  int ReadInputEvents(InputEvent *events, int max_events, int timeout_ms);
+
+  bool GetRefreshStats(RefreshStats *stats);
 
   uint64_t RequestOutputs(uint64_t output_bits);
   void OutputGPIO(uint64_t output_bits);
@@ -97,38 +113,77 @@ public:
 private:
   friend class RGBMatrix;
 
-  // Apply pixel mappers that have been passed down via a configuration
-  // string.
-  void ApplyNamedPixelMappers(const char *pixel_mapper_config,
-                              int chain, int parallel);
+  // Append the pixel mappers that have been passed down via a configuration
+  // string to "mappers".
+  void AppendNamedPixelMappers(const char *pixel_mapper_config,
+                               int chain, int parallel,
+                               std::vector<const PixelMapper*> *mappers);
+
+  // Make "mapper" the one new canvases and canvases coming back from
+  // SwapOnVSync() use. The active canvas might be drawn into through the
+  // RGBMatrix, so it switches in the drawing thread with its next call.
+  void PublishPixelMapper(
+    const std::shared_ptr<internal::PixelDesignatorMap> &mapper);
 
   Options params_;
   bool do_luminance_correct_;
+  internal::Framebuffer::DitherMode dither_mode_;
+  uint32_t dither_frame_;  // Counts SwapOnVSync() to move the dithering.
+  FrameCanvas *last_returned_;  // By SwapOnVSync(), for damage tracking.
 
   FrameCanvas *active_;
 
   GPIO *io_;
-  Mutex active_frame_sync_;
   UpdateThread *updater_;
   std::vector<FrameCanvas*> created_frames_;
-  internal::PixelDesignatorMap *shared_pixel_mapper_;
+
+  // The mapping without any pixel mappers applied, the multiplex mapper
+  // and the current mapping. A new mapping is built from the first two
+  // while drawing goes on, then published in shared_pixel_mapper_; each
+  // canvas keeps using the old one until it picks up the new one.
+  std::shared_ptr<internal::PixelDesignatorMap> physical_pixel_mapper_;
+  const internal::MultiplexMapper *multiplex_mapper_;
+  Mutex remap_lock_;   // Serializes building new mappings.
+  Mutex mapper_lock_;  // Protects shared_pixel_mapper_ and active_.
+  std::shared_ptr<internal::PixelDesignatorMap> shared_pixel_mapper_;
   uint64_t user_output_bits_;
+
+  // Set with SetInputDebounce(), for each GPIO.
+  static constexpr int kMaxInputPins = 8 * sizeof(gpio_bits_t);
+  uint32_t input_debounce_us_[kMaxInputPins];
 };
 
 using namespace internal;
 
+static uint64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::Impl::UpdateThread : public Thread {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame,
                int pwm_dither_bits, bool show_refresh,
-               int limit_refresh_hz, bool allow_busy_waiting)
+               int limit_refresh_hz, bool allow_busy_waiting,
+               bool estimate_power, bool prefault_stack)
     : io_(io), show_refresh_(show_refresh),
       target_frame_usec_(limit_refresh_hz < 1 ? 0 : 1e6/limit_refresh_hz),
       allow_busy_waiting_(allow_busy_waiting),
+      estimate_power_(estimate_power),
+      prefault_stack_(prefault_stack),
       running_(true),
       current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
+      requested_frame_multiple_(1),
+      sampled_inputs_(0), reported_inputs_(0),
+      event_write_pos_(0), event_read_pos_(0), dropped_input_events_(0) {
+    for (int i = 0; i < kMaxInputPins; ++i) {
+      debounce_us_[i] = 0;
+      last_change_us_[i] = 0;
+    }
+    memset(&stats_, 0, sizeof(stats_));
+    stats_.power_limit_scale = 1.0;
     pthread_cond_init(&frame_done_, NULL);
     pthread_cond_init(&input_change_, NULL);
     switch (pwm_dither_bits) {
@@ -164,15 +219,38 @@ public:
     uint32_t initial_holdoff_start = GetMicrosecondCounter();
     bool max_measure_enabled = false;
 
+    if (prefault_stack_) PrefaultStack();
+    struct rusage start_usage;
+    getrusage(RUSAGE_THREAD, &start_usage);
+
     while (running()) {
       const uint32_t start_time_us = GetMicrosecondCounter();
 
+      // Frames are estimated when swapped in, but content might also be
+      // drawn directly onto the displayed frame. So keep re-estimating, a
+      // few rows per refresh to not delay it.
+      if (estimate_power_) {
+        current_frame_->framebuffer()
+          ->ContinuePowerEstimate(kPowerEstimateRowsPerRefresh);
+      }
+
       current_frame_->framebuffer()
         ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
 
       // SwapOnVSync() exchange.
       {
         MutexLock l(&frame_sync_);
+        stats_.refresh_count++;
+        stats_.estimated_power = current_frame_->framebuffer()->power_load();
+        stats_.power_limit_scale = Framebuffer::power_limit_scale();
+        if (stats_.refresh_count % kUsageSampleInterval == 0) {
+          struct rusage usage;
+          getrusage(RUSAGE_THREAD, &usage);
+          stats_.minor_page_faults = usage.ru_minflt - start_usage.ru_minflt;
+          stats_.major_page_faults = usage.ru_majflt - start_usage.ru_majflt;
+          stats_.involuntary_context_switches
+            = usage.ru_nivcsw - start_usage.ru_nivcsw;
+        }
         // Do fast equality test first (likely due to frame_count reset).
         if (frame_count == requested_frame_multiple_
             || frame_count % requested_frame_multiple_ == 0) {
@@ -189,11 +267,14 @@ public:
 
       // Read input bits.
       const gpio_bits_t inputs = io_->Read();
-      if (inputs != last_gpio_bits) {
+      const bool events_queued = ((inputs != reported_inputs_
+                                   || inputs != sampled_inputs_)
+                                  && QueueInputEvents(inputs));
+      if (inputs != last_gpio_bits || events_queued) {
         last_gpio_bits = inputs;
         MutexLock l(&input_sync_);
         gpio_inputs_ = inputs;
-        pthread_cond_signal(&input_change_);
+        pthread_cond_broadcast(&input_change_);
       }
 
       ++frame_count;
@@ -242,7 +323,103 @@ public:
     return gpio_inputs_;
   }
 
+  void SetInputDebounce(gpio_bits_t gpio_bits, uint32_t debounce_us) {
+    for (int i = 0; i < kMaxInputPins; ++i) {
+      if (gpio_bits & ((gpio_bits_t)1 << i))
+        debounce_us_[i].store(debounce_us, std::memory_order_relaxed);
+    }
+  }
+
+  int ReadInputEvents(InputEvent *events, int max_events, int timeout_ms) {
+    // The mutex only serializes readers and is used to wait for new events;
+    // the refresh thread never blocks on it while queueing.
+    MutexLock l(&input_sync_);
+    uint32_t read_pos = event_read_pos_.load(std::memory_order_relaxed);
+    if (timeout_ms != 0
+        && read_pos == event_write_pos_.load(std::memory_order_acquire)) {
+      input_sync_.WaitOn(&input_change_, timeout_ms);
+    }
+    const uint32_t write_pos = event_write_pos_.load(std::memory_order_acquire);
+    int count = 0;
+    while (count < max_events && read_pos != write_pos) {
+      events[count++] = event_queue_[read_pos % kInputEventQueueSize];
+      ++read_pos;
+    }
+    event_read_pos_.store(read_pos, std::memory_order_release);
+    return count;
+  }
+
+  void GetStats(RefreshStats *stats) {
+    MutexLock l(&frame_sync_);
+    *stats = stats_;
+    stats->dropped_input_events
+      = dropped_input_events_.load(std::memory_order_relaxed);
+  }
+
 private:
+  // Double rows of the current frame looked at per refresh to estimate its
+  // power; a full estimate takes double_rows / this many refreshes.
+  static constexpr int kPowerEstimateRowsPerRefresh = 2;
+
+  // Number of refreshes after which we sample resource usage.
+  static constexpr uint32_t kUsageSampleInterval = 16;
+
+  // Size of the input event queue. Needs to be a power of two.
+  static constexpr uint32_t kInputEventQueueSize = 256;
+
+  // Touch a good chunk of stack, so that growing into it later does not
+  // result in page faults. Writes through volatile, so that they are not
+  // optimized away; one byte per page is enough.
+  static void PrefaultStack() {
+    volatile char stack_chunk[64 << 10];
+    const long page_size = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < sizeof(stack_chunk); i += page_size) {
+      stack_chunk[i] = 0;
+    }
+  }
+
+  // Remember when each pin last changed its level, then compare the
+  // sampled "inputs" with the levels reported so far and queue an event for
+  // each pin that differs and has been stable for its debounce time. Pins
+  // still bouncing are picked up in a later refresh once they settled, if
+  // they didn't go back to the reported level.
+  // Returns 'true' if any event was queued.
+  bool QueueInputEvents(gpio_bits_t inputs) {
+    const uint64_t now_us = GetMonotonicMicros();
+    for (gpio_bits_t toggled = inputs ^ sampled_inputs_; toggled;
+         toggled &= toggled - 1) {
+      last_change_us_[__builtin_ctzll(toggled)] = now_us;
+    }
+    sampled_inputs_ = inputs;
+
+    gpio_bits_t changed = inputs ^ reported_inputs_;
+    bool queued = false;
+    while (changed) {
+      const int gpio = __builtin_ctzll(changed);
+      const gpio_bits_t bit = (gpio_bits_t)1 << gpio;
+      changed &= ~bit;
+      if (now_us - last_change_us_[gpio]
+          < debounce_us_[gpio].load(std::memory_order_relaxed)) {
+        continue;
+      }
+      reported_inputs_ ^= bit;
+
+      const uint32_t write_pos = event_write_pos_.load(std::memory_order_relaxed);
+      if (write_pos - event_read_pos_.load(std::memory_order_acquire)
+          >= kInputEventQueueSize) {
+        dropped_input_events_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      InputEvent *event = &event_queue_[write_pos % kInputEventQueueSize];
+      event->timestamp_us = last_change_us_[gpio];
+      event->gpio = gpio;
+      event->value = (inputs & bit) != 0;
+      event_write_pos_.store(write_pos + 1, std::memory_order_release);
+      queued = true;
+    }
+    return queued;
+  }
+
   inline bool running() {
     MutexLock l(&running_mutex_);
     return running_;
@@ -252,6 +429,8 @@ private:
   const bool show_refresh_;
   const uint32_t target_frame_usec_;
   const bool allow_busy_waiting_;
+  const bool estimate_power_;
+  const bool prefault_stack_;
   uint32_t start_bit_[4];
 
   Mutex running_mutex_;
@@ -266,6 +445,19 @@ private:
   FrameCanvas *current_frame_;
   FrameCanvas *next_frame_;
   unsigned requested_frame_multiple_;
+  RefreshStats stats_;
+
+  // Input events. Single producer (the refresh thread), single consumer
+  // (serialized by input_sync_) ring buffer.
+  // Only used in the refresh thread.
+  gpio_bits_t sampled_inputs_;               // Levels at the last refresh.
+  gpio_bits_t reported_inputs_;              // Levels last queued as events.
+  uint64_t last_change_us_[kMaxInputPins];   // Time of last level change.
+  std::atomic<uint32_t> debounce_us_[kMaxInputPins];
+  InputEvent event_queue_[kInputEventQueueSize];
+  std::atomic<uint32_t> event_write_pos_;
+  std::atomic<uint32_t> event_read_pos_;
+  std::atomic<uint32_t> dropped_input_events_;
 };
 
 // Some defaults. See options-initialize.cc for the command line parsing.
@@ -326,10 +518,17 @@ RGBMatrix::Options::Options() :
   limit_refresh_rate_hz(0),
 #endif
 #ifdef DISABLE_BUSY_WAITING
-    disable_busy_waiting(true)
+    disable_busy_waiting(true),
 #else
-    disable_busy_waiting(false)
+    disable_busy_waiting(false),
 #endif
+  hardware_brightness(false),
+  limit_power_percent(0),
+  refresh_cpu(3), refresh_priority(99), refresh_round_robin(false),
+  lock_memory(false),
+  verbose(false),
+  panel_calibration(NULL),
+  dither(NULL)
 {
   // Nothing to see here.
 }
@@ -361,6 +560,15 @@ static void PrintOptions(const RGBMatrix::Options &o) {
   P_STR(panel_type);
   P_INT(limit_refresh_rate_hz);
   P_BOOL(disable_busy_waiting);
+  P_BOOL(hardware_brightness);
+  P_INT(limit_power_percent);
+  P_INT(refresh_cpu);
+  P_INT(refresh_priority);
+  P_BOOL(refresh_round_robin);
+  P_BOOL(lock_memory);
+  P_BOOL(verbose);
+  P_STR(panel_calibration);
+  P_STR(dither);
 #undef P_INT
 #undef P_STR
 #undef P_BOOL
@@ -368,39 +576,71 @@ static void PrintOptions(const RGBMatrix::Options &o) {
 #endif  // DEBUG_MATRIX_OPTIONS
 
 RGBMatrix::Impl::Impl(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL),
+  : params_(options), dither_mode_(Framebuffer::kNoDither), dither_frame_(0),
+    last_returned_(NULL), io_(NULL), updater_(NULL), multiplex_mapper_(NULL),
     user_output_bits_(0) {
+  memset(input_debounce_us_, 0, sizeof(input_debounce_us_));
   assert(params_.Validate(NULL));
+  Framebuffer::DitherModeFromName(params_.dither, &dither_mode_);
 #if DEBUG_MATRIX_OPTIONS
   PrintOptions(params_);
 #endif
-  const MultiplexMapper *multiplex_mapper = NULL;
   if (params_.multiplexing > 0) {
     const MuxMapperList &multiplexers = GetRegisteredMultiplexMappers();
     if (params_.multiplexing <= (int) multiplexers.size()) {
       // TODO: we could also do a find-by-name here, but not sure if worthwhile
-      multiplex_mapper = multiplexers[params_.multiplexing - 1];
+      multiplex_mapper_ = multiplexers[params_.multiplexing - 1];
     }
   }
 
-  if (multiplex_mapper) {
+  if (multiplex_mapper_) {
     // The multiplexers might choose to have a different physical layout.
     // We need to configure that first before setting up the hardware.
-    multiplex_mapper->EditColsRows(&params_.cols, &params_.rows);
+    multiplex_mapper_->EditColsRows(&params_.cols, &params_.rows);
   }
 
   Framebuffer::InitHardwareMapping(params_.hardware_mapping);
+  if (params_.hardware_brightness) {
+    Framebuffer::SetHardwareBrightness(params_.brightness);
+  }
+  Framebuffer::SetPowerLimit(params_.limit_power_percent / 100.0f);
 
+  const uint64_t start_us = GetMonotonicMicros();
   active_ = CreateFrameCanvas();
+  if (params_.panel_calibration && *params_.panel_calibration) {
+    std::shared_ptr<internal::PixelDesignatorMap> calibrated(
+      CreateCalibratedPixels(*shared_pixel_mapper_, params_.panel_calibration,
+                             params_.chain_length, params_.parallel));
+    if (calibrated) {
+      shared_pixel_mapper_ = calibrated;
+      active_->framebuffer()->SetPixelMapper(calibrated);
+    }
+  }
   active_->Clear();
+  physical_pixel_mapper_ = shared_pixel_mapper_;
+  const uint64_t framebuffer_done_us = GetMonotonicMicros();
   SetGPIO(io, true);
-
-  // We need to apply the mapping for the panels first.
-  ApplyPixelMapper(multiplex_mapper);
-
-  // .. followed by higher level mappers that might arrange panels.
-  ApplyNamedPixelMappers(options.pixel_mapper_config,
-                         params_.chain_length, params_.parallel);
+  const uint64_t gpio_done_us = GetMonotonicMicros();
+
+  // We need to apply the mapping for the panels first, followed by higher
+  // level mappers that might arrange panels.
+  std::vector<const PixelMapper*> mappers;
+  mappers.push_back(multiplex_mapper_);
+  AppendNamedPixelMappers(options.pixel_mapper_config,
+                          params_.chain_length, params_.parallel, &mappers);
+  ApplyPixelMappers(mappers);
+  const uint64_t mapping_done_us = GetMonotonicMicros();
+
+  if (params_.verbose) {
+    fprintf(stderr, "Startup %dx%d: framebuffer %.1fms, GPIO %.1fms, "
+            "pixel mapping %.1fms (%d runs); total %.1fms\n",
+            shared_pixel_mapper_->width(), shared_pixel_mapper_->height(),
+            (framebuffer_done_us - start_us) / 1000.0,
+            (gpio_done_us - framebuffer_done_us) / 1000.0,
+            (mapping_done_us - gpio_done_us) / 1000.0,
+            shared_pixel_mapper_->run_count(),
+            (mapping_done_us - start_us) / 1000.0);
+  }
 }
 
 RGBMatrix::Impl::~Impl() {
@@ -417,7 +657,6 @@ RGBMatrix::Impl::~Impl() {
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     delete created_frames_[i];
   }
-  delete shared_pixel_mapper_;
 }
 
 RGBMatrix::~RGBMatrix() {
@@ -438,8 +677,9 @@ void RGBMatrix::Impl::OutputGPIO(uint64_t output_bits) {
   io_->WriteMaskedBits(static_cast<gpio_bits_t>(output_bits), static_cast<gpio_bits_t>(user_output_bits_));
 }
 
-void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
-                                             int chain, int parallel) {
+void RGBMatrix::Impl::AppendNamedPixelMappers(
+  const char *pixel_mapper_config, int chain, int parallel,
+  std::vector<const PixelMapper*> *mappers) {
   if (pixel_mapper_config == NULL || strlen(pixel_mapper_config) == 0)
     return;
   char *const writeable_copy = strdup(pixel_mapper_config);
@@ -456,7 +696,8 @@ void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config,
       fprintf(stderr, "Stray parameter ':%s' without mapper name ?\n", optional_param_start);
     }
     if (*s) {
-      ApplyPixelMapper(FindPixelMapper(s, chain, parallel, optional_param_start));
+      mappers->push_back(FindPixelMapper(s, chain, parallel,
+                                         optional_param_start));
     }
     s = semicolon + 1;
   }
@@ -483,20 +724,41 @@ bool RGBMatrix::Impl::StartRefresh() {
     updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
                                 params_.show_refresh_rate,
                                 params_.limit_refresh_rate_hz,
-                                !params_.disable_busy_waiting);
+                                !params_.disable_busy_waiting,
+                                params_.limit_power_percent > 0,
+                                params_.lock_memory);
+    if (params_.lock_memory) {
+      // All framebuffers are fully written when created, so locking the
+      // current memory also faults them all in. Future allocations are
+      // locked (and with that prefaulted) as well.
+      if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        perror("Can't lock memory (mlockall())");
+      }
+    }
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
-    // So let's tie it to the last CPU available.
-    // The Raspberry Pi2 has 4 cores, our attempt to bind it to
-    //   core #3 will succeed.
-    // The Raspberry Pi1 only has one core, so this affinity
-    //   call will simply fail and we keep using the only core.
-    updater_->Start(99, (1<<3));  // Prio: high. Also: put on last CPU.
+    // So let's tie it to one CPU, by default the last one of a four-core Pi.
+    // On boards with only one core, the affinity call will simply fail and
+    // we keep using the only core.
+    PrepareRefreshCPU(params_.refresh_cpu);
+    const uint32_t affinity_mask = (params_.refresh_cpu >= 0)
+      ? (1u << params_.refresh_cpu) : 0;
+    for (int i = 0; i < kMaxInputPins; ++i) {
+      updater_->SetInputDebounce((gpio_bits_t)1 << i, input_debounce_us_[i]);
+    }
+    updater_->set_realtime_policy(params_.refresh_round_robin
+                                  ? SCHED_RR : SCHED_FIFO);
+    updater_->Start(params_.refresh_priority, affinity_mask);
   }
   return updater_ != NULL;
 }
 
 FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
+  std::shared_ptr<internal::PixelDesignatorMap> mapper;
+  {
+    MutexLock l(&mapper_lock_);
+    mapper = shared_pixel_mapper_;
+  }
   FrameCanvas *result =
     new FrameCanvas(new Framebuffer(params_.rows,
                                     params_.cols * params_.chain_length,
@@ -504,15 +766,21 @@ FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas() {
                                     params_.scan_mode,
                                     params_.led_rgb_sequence,
                                     params_.inverse_colors,
-                                    &shared_pixel_mapper_));
+                                    mapper));
   if (created_frames_.empty()) {
-    // First time. Get defaults from initial Framebuffer.
+    // First time. Get defaults from initial Framebuffer, which also set up
+    // the physical mapping.
     do_luminance_correct_ = result->framebuffer()->luminance_correct();
+    shared_pixel_mapper_ = result->framebuffer()->pixel_mapper();
   }
 
   result->framebuffer()->SetPWMBits(params_.pwm_bits);
+  result->framebuffer()->SetDither(dither_mode_);
   result->framebuffer()->set_luminance_correct(do_luminance_correct_);
-  result->framebuffer()->SetBrightness(params_.brightness);
+  // With hardware brightness, the content is always rendered at full
+  // brightness and dimmed while being displayed.
+  result->framebuffer()->SetBrightness(params_.hardware_brightness
+                                       ? 100 : params_.brightness);
 
   created_frames_.push_back(result);
 
@@ -536,8 +804,33 @@ FrameCanvas *RGBMatrix::Impl::SwapOnVSync(FrameCanvas *other,
                                           unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
   if (!updater_) return NULL;
+  if (other && params_.limit_power_percent > 0) {
+    // Estimate here in the caller's thread, not the refresh thread.
+    other->framebuffer()->EstimatePowerLoad();
+  }
   FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
-  if (other) active_ = other;
+  if (other && previous && other != previous
+      && other->framebuffer()->tracks_damage()) {
+    // "other" only differs from "previous" by its damage if it was drawn
+    // starting from the canvas we returned last time.
+    if (other != last_returned_) other->framebuffer()->AddFullDamage();
+    other->framebuffer()->CopyDamageTo(previous->framebuffer());
+  }
+  last_returned_ = previous;
+  MutexLock l(&mapper_lock_);
+  if (other) {
+    active_ = other;
+    // Might be drawn into directly through the RGBMatrix from now on.
+    if (active_->framebuffer()->pixel_mapper() != shared_pixel_mapper_) {
+      active_->framebuffer()->SetPendingPixelMapper(shared_pixel_mapper_);
+    }
+  }
+  // Not displayed anymore and not drawn into yet: a good time to switch to
+  // a new mapping.
+  if (previous) {
+    previous->framebuffer()->SetPixelMapper(shared_pixel_mapper_);
+    previous->framebuffer()->set_dither_frame(++dither_frame_);
+  }
   return previous;
 }
 
@@ -546,6 +839,30 @@ uint64_t RGBMatrix::Impl::AwaitInputChange(int timeout_ms) {
   return updater_->AwaitInputChange(timeout_ms);
 }
 
+void RGBMatrix::Impl::SetInputDebounce(uint64_t gpio_bits, int debounce_us) {
+  if (debounce_us < 0) debounce_us = 0;
+  // Kept here as well for the refresh thread started later.
+  for (int i = 0; i < kMaxInputPins; ++i) {
+    if (gpio_bits & ((uint64_t)1 << i)) input_debounce_us_[i] = debounce_us;
+  }
+  if (updater_) {
+    updater_->SetInputDebounce(static_cast<gpio_bits_t>(gpio_bits),
+                               debounce_us);
+  }
+}
+
+int RGBMatrix::Impl::ReadInputEvents(InputEvent *events, int max_events,
+                                     int timeout_ms) {
+  if (!updater_ || max_events <= 0) return 0;
+  return updater_->ReadInputEvents(events, max_events, timeout_ms);
+}
+
+bool RGBMatrix::Impl::GetRefreshStats(RefreshStats *stats) {
+  if (!updater_) return false;
+  updater_->GetStats(stats);
+  return true;
+}
+
 bool RGBMatrix::Impl::SetPWMBits(uint8_t value) {
   const bool success = active_->framebuffer()->SetPWMBits(value);
   if (success) {
@@ -565,8 +882,12 @@ bool RGBMatrix::Impl::luminance_correct() const {
 }
 
 void RGBMatrix::Impl::SetBrightness(uint8_t brightness) {
-  for (size_t i = 0; i < created_frames_.size(); ++i) {
-    created_frames_[i]->framebuffer()->SetBrightness(brightness);
+  if (params_.hardware_brightness) {
+    Framebuffer::SetHardwareBrightness(brightness);
+  } else {
+    for (size_t i = 0; i < created_frames_.size(); ++i) {
+      created_frames_[i]->framebuffer()->SetBrightness(brightness);
+    }
   }
   params_.brightness = brightness;
 }
@@ -575,36 +896,44 @@ uint8_t RGBMatrix::Impl::brightness() {
   return params_.brightness;
 }
 
+void RGBMatrix::Impl::PublishPixelMapper(
+  const std::shared_ptr<internal::PixelDesignatorMap> &mapper) {
+  MutexLock l(&mapper_lock_);
+  shared_pixel_mapper_ = mapper;
+  active_->framebuffer()->SetPendingPixelMapper(mapper);
+}
+
 bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper) {
-  if (mapper == NULL) return true;
-  using internal::PixelDesignatorMap;
-  const int old_width = shared_pixel_mapper_->width();
-  const int old_height = shared_pixel_mapper_->height();
-  int new_width, new_height;
-  if (!mapper->GetSizeMapping(old_width, old_height, &new_width, &new_height)) {
-    return false;
-  }
-  PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
-  for (int y = 0; y < new_height; ++y) {
-    for (int x = 0; x < new_width; ++x) {
-      int orig_x = -1, orig_y = -1;
-      mapper->MapVisibleToMatrix(old_width, old_height,
-                                 x, y, &orig_x, &orig_y);
-      if (orig_x < 0 || orig_y < 0 ||
-          orig_x >= old_width || orig_y >= old_height) {
-        fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) [range: "
-                "%dx%d]\n", x, y, orig_x, orig_y, old_width, old_height);
-        continue;
-      }
-      const internal::PixelDesignator *orig_designator;
-      orig_designator = shared_pixel_mapper_->get(orig_x, orig_y);
-      *new_mapper->get(x, y) = *orig_designator;
-    }
+  return ApplyPixelMappers(std::vector<const PixelMapper*>(1, mapper));
+}
+
+bool RGBMatrix::Impl::ApplyPixelMappers(
+  const std::vector<const PixelMapper*> &mappers) {
+  MutexLock l(&remap_lock_);
+  bool all_applied;
+  std::shared_ptr<internal::PixelDesignatorMap> mapped(
+    CreateMappedPixels(*shared_pixel_mapper_, mappers, &all_applied));
+  if (mapped == NULL) return all_applied;
+  PublishPixelMapper(mapped);
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->framebuffer()->SetPixelMapper(mapped);
   }
-  delete shared_pixel_mapper_;
-  shared_pixel_mapper_ = new_mapper;
-  return true;
+  return all_applied;
+}
+
+bool RGBMatrix::Impl::RemapPixels(const char *pixel_mapper_config) {
+  MutexLock l(&remap_lock_);
+  // The mappers are applied from scratch on the physical layout.
+  std::vector<const PixelMapper*> mappers;
+  mappers.push_back(multiplex_mapper_);
+  AppendNamedPixelMappers(pixel_mapper_config,
+                          params_.chain_length, params_.parallel, &mappers);
+  bool all_applied;
+  std::shared_ptr<internal::PixelDesignatorMap> mapped(
+    CreateMappedPixels(*physical_pixel_mapper_, mappers, &all_applied));
+  if (mapped == NULL) mapped = physical_pixel_mapper_;
+  PublishPixelMapper(mapped);
+  return all_applied;
 }
 
 // -- Public interface of RGBMatrix. Delegate everything to impl_
@@ -722,6 +1051,10 @@ FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
 bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
   return impl_->ApplyPixelMapper(mapper);
 }
+
+bool RGBMatrix::RemapPixels(const char *pixel_mapper_config) {
+  return impl_->RemapPixels(pixel_mapper_config);
+}
 bool RGBMatrix::SetPWMBits(uint8_t value) { return impl_->SetPWMBits(value); }
 uint8_t RGBMatrix::pwmbits() { return impl_->pwmbits(); }
 
@@ -741,6 +1074,13 @@ uint64_t RGBMatrix::RequestInputs(uint64_t all_interested_bits) {
 uint64_t RGBMatrix::AwaitInputChange(int timeout_ms) {
   return impl_->AwaitInputChange(timeout_ms);
 }
+void RGBMatrix::SetInputDebounce(uint64_t gpio_bits, int debounce_us) {
+  impl_->SetInputDebounce(gpio_bits, debounce_us);
+}
+int RGBMatrix::ReadInputEvents(InputEvent *events, int max_events,
+                               int timeout_ms) {
+  return impl_->ReadInputEvents(events, max_events, timeout_ms);
+}
 
 uint64_t RGBMatrix::RequestOutputs(uint64_t all_interested_bits) {
   return impl_->RequestOutputs(all_interested_bits);
@@ -749,26 +1089,37 @@ void RGBMatrix::OutputGPIO(uint64_t output_bits) {
   impl_->OutputGPIO(output_bits);
 }
 
+bool RGBMatrix::GetRefreshStats(RefreshStats *stats) {
+  return impl_->GetRefreshStats(stats);
+}
+
 bool RGBMatrix::StartRefresh() { return impl_->StartRefresh(); }
 
 // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
+// Each call first picks up a mapping RemapPixels() might have published
+// for the active canvas.
 int RGBMatrix::width() const {
+  impl_->active_->framebuffer()->AdoptPendingPixelMapper();
   return impl_->active_->width();
 }
 
 int RGBMatrix::height() const {
+  impl_->active_->framebuffer()->AdoptPendingPixelMapper();
   return impl_->active_->height();
 }
 
 void RGBMatrix::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+  impl_->active_->framebuffer()->AdoptPendingPixelMapper();
   impl_->active_->SetPixel(x, y, red, green, blue);
 }
 
 void RGBMatrix::Clear() {
+  impl_->active_->framebuffer()->AdoptPendingPixelMapper();
   impl_->active_->Clear();
 }
 
 void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue) {
+  impl_->active_->framebuffer()->AdoptPendingPixelMapper();
   impl_->active_->Fill(red, green, blue);
 }
 
@@ -807,4 +1158,7 @@ bool FrameCanvas::Deserialize(const char *data, size_t len) {
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
+void FrameCanvas::AddDamage(int x, int y, int width, int height) {
+  frame_->AddDamage(x, y, width, height);
+}
 }  // end namespace rgb_matrix
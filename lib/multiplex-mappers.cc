@@ -15,6 +15,10 @@
 
 #include "multiplex-mappers-internal.h"
 
+#include <map>
+#include <utility>
+#include <vector>
+
 namespace rgb_matrix {
 namespace internal {
 // A Pixel Mapper maps physical pixels locations to the internal logical
@@ -22,7 +26,7 @@ namespace internal {
 class MultiplexMapperBase : public MultiplexMapper {
 public:
   MultiplexMapperBase(const char *name, int stretch_factor)
-    : name_(name), panel_stretch_factor_(stretch_factor) {}
+    : name_(name), panel_stretch_factor_(stretch_factor), panel_map_(NULL) {}
 
   // This method is const, but we sneakily remember the original size
   // of the panels so that we can more easily quantize things.
@@ -42,6 +46,7 @@ public:
     // Matrix width has been altered. Alter it back.
     *visible_width = matrix_width / panel_stretch_factor_;
     *visible_height = matrix_height * panel_stretch_factor_;
+    panel_map_ = &GetPanelMap();
     return true;
   }
 
@@ -49,7 +54,9 @@ public:
 
   // The MapVisibleToMatrix() as required by PanelMatrix here breaks it
   // down to the individual panel, so that derived classes only need to
-  // implement MapSinglePanel().
+  // implement MapSinglePanel(). That is only called once per pixel of a
+  // single panel to fill the panel map in GetSizeMapping(); all panels
+  // then use that.
   virtual void MapVisibleToMatrix(int matrix_width, int matrix_height,
                                   int visible_x, int visible_y,
                                   int *matrix_x, int *matrix_y) const {
@@ -59,10 +66,10 @@ public:
     const int within_panel_x = visible_x % panel_cols_;
     const int within_panel_y = visible_y % panel_rows_;
 
-    int new_x, new_y;
-    MapSinglePanel(within_panel_x, within_panel_y, &new_x, &new_y);
-    *matrix_x = chained_panel  * panel_stretch_factor_*panel_cols_ + new_x;
-    *matrix_y = parallel_panel * panel_rows_/panel_stretch_factor_ + new_y;
+    const PanelPosition &pos
+      = (*panel_map_)[within_panel_y * panel_cols_ + within_panel_x];
+    *matrix_x = chained_panel  * panel_stretch_factor_*panel_cols_ + pos.x;
+    *matrix_y = parallel_panel * panel_rows_/panel_stretch_factor_ + pos.y;
   }
 
   // Map the coordinates for a single panel. This is to be overridden in
@@ -78,6 +85,33 @@ protected:
 
   mutable int panel_cols_;
   mutable int panel_rows_;
+
+private:
+  struct PanelPosition {
+    int x, y;
+  };
+  typedef std::vector<PanelPosition> PanelMap;
+
+  // Result of MapSinglePanel() for all pixels of a panel of the current
+  // size, row by row. Created once per panel size and kept, as the mapper
+  // is a singleton that can serve several matrices.
+  const PanelMap &GetPanelMap() const {
+    PanelMap &map = panel_maps_[std::make_pair(panel_cols_, panel_rows_)];
+    if (map.empty()) {
+      map.resize(panel_cols_ * panel_rows_);
+      PanelPosition *pos = map.data();
+      for (int y = 0; y < panel_rows_; ++y) {
+        for (int x = 0; x < panel_cols_; ++x, ++pos) {
+          pos->x = pos->y = 0;
+          MapSinglePanel(x, y, &pos->x, &pos->y);
+        }
+      }
+    }
+    return map;
+  }
+
+  mutable std::map<std::pair<int, int>, PanelMap> panel_maps_;
+  mutable const PanelMap *panel_map_;  // The one for the current size.
 };
 
 
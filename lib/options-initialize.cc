@@ -158,6 +158,11 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeStringFlag("panel-type", it, end,
                             &mopts->panel_type, &err))
         continue;
+      if (ConsumeStringFlag("panel-calibration", it, end,
+                            &mopts->panel_calibration, &err))
+        continue;
+      if (ConsumeStringFlag("dither", it, end, &mopts->dither, &err))
+        continue;
       if (ConsumeIntFlag("rows", it, end, &mopts->rows, &err))
         continue;
       if (ConsumeIntFlag("cols", it, end, &mopts->cols, &err))
@@ -186,10 +191,28 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeIntFlag("limit-refresh", it, end,
                          &mopts->limit_refresh_rate_hz, &err))
         continue;
+      if (ConsumeIntFlag("limit-power", it, end,
+                         &mopts->limit_power_percent, &err))
+        continue;
+      if (ConsumeIntFlag("refresh-cpu", it, end, &mopts->refresh_cpu, &err))
+        continue;
+      if (ConsumeIntFlag("refresh-priority", it, end,
+                         &mopts->refresh_priority, &err))
+        continue;
+      if (ConsumeBoolFlag("refresh-round-robin", it,
+                          &mopts->refresh_round_robin))
+        continue;
+      if (ConsumeBoolFlag("lock-memory", it, &mopts->lock_memory))
+        continue;
+      if (ConsumeBoolFlag("verbose", it, &mopts->verbose))
+        continue;
       if (ConsumeBoolFlag("show-refresh", it, &mopts->show_refresh_rate))
         continue;
       if (ConsumeBoolFlag("inverse", it, &mopts->inverse_colors))
         continue;
+      if (ConsumeBoolFlag("hardware-brightness", it,
+                          &mopts->hardware_brightness))
+        continue;
       // We don't have a swap_green_blue option anymore, but we simulate the
       // flag for a while.
       bool swap_green_blue;
@@ -328,6 +351,7 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t                            Available: %s. Default: \"\"\n"
           "\t--led-pwm-bits=<1..%d>    : PWM bits (Default: %d).\n"
           "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
+          "\t--led-%shardware-brightness : %spply brightness via output-enable pulse length.\n"
           "\t--led-scan-mode=<0..1>    : 0 = progressive; 1 = interlaced "
           "(Default: %d).\n"
           "\t--led-row-addr-type=<0..4>: 0 = default; 1 = AB-addressed panels; 2 = direct row select; 3 = ABC-addressed panels; 4 = ABC Shift + DE direct "
@@ -335,6 +359,7 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t--led-%sshow-refresh        : %show refresh rate.\n"
           "\t--led-limit-refresh=<Hz>  : Limit refresh rate to this frequency in Hz. Useful to keep a\n"
           "\t                            constant refresh rate on loaded system. 0=no limit. Default: %d\n"
+          "\t--led-limit-power=<percent>: Limit LED power to percent of full white. 0=no limit. Default: %d\n"
           "\t--led-%sinverse             "
           ": Switch if your matrix has inverse colors %s.\n"
           "\t--led-rgb-sequence        : Switch if your matrix has led colors "
@@ -343,23 +368,42 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "(Default: %d)\n"
           "\t--led-pwm-dither-bits=<0..2> : Time dithering of lower bits "
           "(Default: 0)\n"
+          "\t--led-dither=<mode>       : Dither colors with low --led-pwm-bits: "
+          "none, bayer, blue-noise (Default: none)\n"
           "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n"
           "\t--led-panel-type=<name>   : Needed to initialize special panels. Supported: 'FM6126A', 'FM6127'\n"
-          "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n",
+          "\t--led-panel-calibration=<file> : Color correction for individual panels.\n"
+          "\t--led-%sbusy-waiting     : %sse busy waiting when limiting refresh rate.\n"
+          "\t--led-refresh-cpu=<cpu>   : CPU core to run the refresh thread on. -1=any. (Default: %d)\n"
+          "\t--led-refresh-priority=<0..99> : Realtime priority of refresh thread. 0=not realtime. (Default: %d)\n"
+          "\t--led-%srefresh-round-robin : %sse SCHED_RR instead of SCHED_FIFO for refresh thread.\n"
+          "\t--led-%slock-memory       : %sock process memory to avoid page faults while refreshing.\n"
+          "\t--led-%sverbose           : %srint diagnostics such as startup timing.\n",
           d.hardware_mapping,
           d.rows, d.cols, d.chain_length, d.parallel,
           (int) muxers.size(), CreateAvailableMultiplexString(muxers).c_str(),
           available_mappers.c_str(),
           internal::Framebuffer::kBitPlanes, d.pwm_bits,
-          d.brightness, d.scan_mode,
+          d.brightness,
+          d.hardware_brightness ? "no-" : "",
+          d.hardware_brightness ? "Don't a" : "A",
+          d.scan_mode,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
           d.limit_refresh_rate_hz,
+          d.limit_power_percent,
           d.inverse_colors ? "no-" : "",    d.inverse_colors ? "off" : "on",
           d.pwm_lsb_nanoseconds,
           !d.disable_hardware_pulsing ? "no-" : "",
           !d.disable_hardware_pulsing ? "Don't u" : "U",
           !d.disable_busy_waiting ? "no-" : "",
-          !d.disable_busy_waiting ? "Don't u" : "U");
+          !d.disable_busy_waiting ? "Don't u" : "U",
+          d.refresh_cpu, d.refresh_priority,
+          d.refresh_round_robin ? "no-" : "",
+          d.refresh_round_robin ? "Don't u" : "U",
+          d.lock_memory ? "no-" : "",
+          d.lock_memory ? "Don't l" : "L",
+          d.verbose ? "no-" : "",
+          d.verbose ? "Don't p" : "P");
 
   fprintf(out,
           "\t--led-slowdown-gpio=<%d..4>: "
@@ -452,6 +496,21 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  if (limit_power_percent < 0 || limit_power_percent > 100) {
+    err->append("Power limit outside usable range (Percent 0..100 allowed).\n");
+    success = false;
+  }
+
+  if (refresh_cpu < -1 || refresh_cpu > 31) {
+    err->append("Invalid refresh CPU (-1..31 allowed).\n");
+    success = false;
+  }
+
+  if (refresh_priority < 0 || refresh_priority > 99) {
+    err->append("Invalid refresh thread priority (0..99 allowed).\n");
+    success = false;
+  }
+
   if (scan_mode < 0 || scan_mode > 1) {
     err->append("Invalid scan mode (0 or 1 allowed).\n");
     success = false;
@@ -467,6 +526,12 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  internal::Framebuffer::DitherMode dither_mode;
+  if (!internal::Framebuffer::DitherModeFromName(dither, &dither_mode)) {
+    err->append("Dither mode can only be one of none, bayer, blue-noise.\n");
+    success = false;
+  }
+
   if (led_rgb_sequence == NULL || strlen(led_rgb_sequence) != 3) {
     err->append("led-sequence needs to be three characters long.\n");
     success = false;
@@ -16,9 +16,14 @@
 #include "pixel-mapper.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <map>
 
@@ -283,6 +288,112 @@ private:
   int parallel_;
 };
 
+// Arbitrary arrangements from a precomputed mapping file, e.g. created with
+// utils/pixel-mapping-generator from a description of the panel layout.
+// The file is mmap()ed, so even huge layouts load quickly. Its layout, all
+// little-endian:
+//
+//   uint32_t magic;          0x50414D50 ("PMAP")
+//   uint32_t version;        1
+//   uint32_t matrix_width;   Size of the matrix the file is made for.
+//   uint32_t matrix_height;
+//   uint32_t visible_width;  Size of the resulting canvas.
+//   uint32_t visible_height;
+//   uint32_t reserved[2];
+//   Then for each visible pixel, row by row:
+//     uint16_t matrix_x, matrix_y;   0xffff, 0xffff: gap, not shown.
+class FilePixelMapper : public PixelMapper {
+public:
+  FilePixelMapper() : header_(NULL), size_(0) {}
+
+  virtual const char *GetName() const { return "File"; }
+
+  virtual bool SetParameters(int chain, int parallel, const char *param) {
+    Unmap();
+    if (param == NULL || *param == '\0') {
+      fprintf(stderr, "File: need the name of a mapping file, e.g. "
+              "File:/home/pi/wall.map\n");
+      return false;
+    }
+    const int fd = open(param, O_RDONLY);
+    if (fd < 0) {
+      perror(param);
+      return false;
+    }
+    struct stat s;
+    void *mapped = MAP_FAILED;
+    if (fstat(fd, &s) == 0 && (size_t)s.st_size >= sizeof(FileHeader)) {
+      mapped = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      fprintf(stderr, "File: can't map %s\n", param);
+      return false;
+    }
+    header_ = (const FileHeader*) mapped;
+    size_ = s.st_size;
+    const uint64_t pixels = (uint64_t)header_->visible_width
+      * header_->visible_height;
+    if (header_->magic != kMagicValue || header_->version != 1
+        || size_ < sizeof(FileHeader) + pixels * sizeof(Entry)) {
+      fprintf(stderr, "File: %s is not a valid mapping file\n", param);
+      Unmap();
+      return false;
+    }
+    return true;
+  }
+
+  virtual bool GetSizeMapping(int matrix_width, int matrix_height,
+                              int *visible_width, int *visible_height)
+    const {
+    if (header_ == NULL) return false;
+    if ((int)header_->matrix_width != matrix_width
+        || (int)header_->matrix_height != matrix_height) {
+      fprintf(stderr, "File: mapping is made for a %dx%d matrix, but this "
+              "one is %dx%d\n", header_->matrix_width, header_->matrix_height,
+              matrix_width, matrix_height);
+      return false;
+    }
+    *visible_width = header_->visible_width;
+    *visible_height = header_->visible_height;
+    return true;
+  }
+
+  virtual void MapVisibleToMatrix(int matrix_width, int matrix_height,
+                                  int x, int y,
+                                  int *matrix_x, int *matrix_y) const {
+    const Entry *entries = (const Entry*) (header_ + 1);
+    const Entry &e = entries[y * header_->visible_width + x];
+    *matrix_x = (e.x == kGap) ? -1 : e.x;
+    *matrix_y = (e.y == kGap) ? -1 : e.y;
+  }
+
+private:
+  static constexpr uint32_t kMagicValue = 0x50414D50;
+  static constexpr uint16_t kGap = 0xffff;
+  struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t matrix_width;
+    uint32_t matrix_height;
+    uint32_t visible_width;
+    uint32_t visible_height;
+    uint32_t reserved[2];
+  };
+  struct Entry {
+    uint16_t x;
+    uint16_t y;
+  };
+
+  void Unmap() {
+    if (header_) munmap((void*) header_, size_);
+    header_ = NULL;
+    size_ = 0;
+  }
+
+  const FileHeader *header_;
+  size_t size_;
+};
 
 typedef std::map<std::string, PixelMapper*> MapperByName;
 static void RegisterPixelMapperInternal(MapperByName *registry,
@@ -302,6 +413,7 @@ static MapperByName *CreateMapperMap() {
   RegisterPixelMapperInternal(result, new UArrangementMapper());
   RegisterPixelMapperInternal(result, new VerticalMapper());
   RegisterPixelMapperInternal(result, new MirrorPixelMapper());
+  RegisterPixelMapperInternal(result, new FilePixelMapper());
   return result;
 }
 
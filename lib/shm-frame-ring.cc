@@ -0,0 +1,216 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "shm-frame-ring.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "graphics.h"
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+
+// Pre-c++11 helper
+#define STATIC_ASSERT(msg, c) typedef int static_assert_##msg[(c) ? 1 : -1]
+
+namespace {
+static const uint32_t kRingMagicValue = 0x474E5252;
+static const uint32_t kRingVersion = 1;
+
+// See header for a description of the layout.
+struct RingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t slot_count;
+  uint32_t slot_stride;
+  uint64_t next_sequence;
+  uint64_t published;
+  uint8_t reserved[24];
+};
+STATIC_ASSERT(ring_header_size_changed, sizeof(RingHeader) == 64);
+
+struct RingSlot {
+  uint64_t state;
+  uint8_t reserved[56];
+  // Followed by pixels.
+};
+STATIC_ASSERT(ring_slot_size_changed, sizeof(RingSlot) == 64);
+
+static inline RingHeader *HeaderOf(char *memory) {
+  return reinterpret_cast<RingHeader*>(memory);
+}
+static inline RingSlot *AsSlot(char *slot) {
+  return reinterpret_cast<RingSlot*>(slot);
+}
+static inline Color *PixelsOf(char *slot) {
+  return reinterpret_cast<Color*>(slot + sizeof(RingSlot));
+}
+}  // namespace
+
+ShmFrameRing::ShmFrameRing(const std::string &name, bool owner,
+                           char *memory, size_t size,
+                           int width, int height, int slot_count,
+                           size_t slot_stride)
+  : name_(name), owner_(owner), memory_(memory), size_(size),
+    width_(width), height_(height), slot_count_(slot_count),
+    slot_stride_(slot_stride), writing_slot_(NULL), writing_sequence_(0) {}
+
+ShmFrameRing::~ShmFrameRing() {
+  munmap(memory_, size_);
+  if (owner_) shm_unlink(name_.c_str());
+}
+
+ShmFrameRing *ShmFrameRing::Create(const char *name, int width, int height,
+                                   int slot_count) {
+  if (width <= 0 || height <= 0 || slot_count < 2) return NULL;
+  const size_t pixel_bytes = (size_t)width * height * sizeof(Color);
+  const size_t stride = (sizeof(RingSlot) + pixel_bytes + 63) & ~(size_t)63;
+  const size_t size = sizeof(RingHeader) + stride * slot_count;
+
+  shm_unlink(name);  // Left over from a previous server.
+  const int fd = shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0666);
+  if (fd < 0) {
+    perror("Can't create shared memory");
+    return NULL;
+  }
+  fchmod(fd, 0666);  // Not restricted by umask; producers run as any user.
+  if (ftruncate(fd, size) < 0) {
+    perror("Can't size shared memory");
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+  char *memory = (char*)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                             fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    perror("Can't mmap() shared memory");
+    shm_unlink(name);
+    return NULL;
+  }
+  // Freshly created shared memory is all zero.
+  RingHeader *header = HeaderOf(memory);
+  header->version = kRingVersion;
+  header->width = width;
+  header->height = height;
+  header->slot_count = slot_count;
+  header->slot_stride = stride;
+  // Last, so that producers only attach to a fully set up ring.
+  __atomic_store_n(&header->magic, kRingMagicValue, __ATOMIC_RELEASE);
+  return new ShmFrameRing(name, true, memory, size,
+                          width, height, slot_count, stride);
+}
+
+ShmFrameRing *ShmFrameRing::Attach(const char *name) {
+  const int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    perror("Can't open shared memory (is the display server running?)");
+    return NULL;
+  }
+  struct stat s;
+  char *memory = (char*)MAP_FAILED;
+  if (fstat(fd, &s) == 0 && (size_t)s.st_size >= sizeof(RingHeader)) {
+    memory = (char*)mmap(NULL, s.st_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                         fd, 0);
+  }
+  close(fd);
+  if (memory == MAP_FAILED) {
+    fprintf(stderr, "Can't map shared memory %s\n", name);
+    return NULL;
+  }
+  // Validate a private copy, other processes might change the original.
+  const bool has_magic = (__atomic_load_n(&HeaderOf(memory)->magic,
+                                          __ATOMIC_ACQUIRE) == kRingMagicValue);
+  RingHeader header;
+  memcpy(&header, memory, sizeof(header));
+  const uint64_t pixel_bytes = (uint64_t)header.width * header.height
+    * sizeof(Color);
+  if (!has_magic
+      || header.version != kRingVersion
+      || header.width == 0 || header.width > 65536
+      || header.height == 0 || header.height > 65536
+      || header.slot_count < 2
+      || header.slot_stride < sizeof(RingSlot) + pixel_bytes
+      || sizeof(RingHeader) + (uint64_t)header.slot_stride * header.slot_count
+      > (uint64_t)s.st_size) {
+    fprintf(stderr, "%s is not a compatible frame ring\n", name);
+    munmap(memory, s.st_size);
+    return NULL;
+  }
+  return new ShmFrameRing(name, false, memory, s.st_size,
+                          header.width, header.height, header.slot_count,
+                          header.slot_stride);
+}
+
+int ShmFrameRing::width() const { return width_; }
+int ShmFrameRing::height() const { return height_; }
+
+char *ShmFrameRing::SlotFor(uint64_t sequence) const {
+  return memory_ + sizeof(RingHeader)
+    + (sequence % slot_count_) * slot_stride_;
+}
+
+Color *ShmFrameRing::BeginFrame() {
+  writing_sequence_ = __atomic_fetch_add(&HeaderOf(memory_)->next_sequence, 1,
+                                         __ATOMIC_RELAXED);
+  writing_slot_ = SlotFor(writing_sequence_);
+  __atomic_store_n(&AsSlot(writing_slot_)->state, 2 * writing_sequence_ + 1,
+                   __ATOMIC_RELAXED);
+  // Pixel writes must not become visible before the state change.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return PixelsOf(writing_slot_);
+}
+
+void ShmFrameRing::PublishFrame() {
+  if (writing_slot_ == NULL) return;
+  __atomic_store_n(&AsSlot(writing_slot_)->state, 2 * writing_sequence_ + 2,
+                   __ATOMIC_RELEASE);
+  uint64_t *const published = &HeaderOf(memory_)->published;
+  uint64_t current = __atomic_load_n(published, __ATOMIC_RELAXED);
+  while (current < writing_sequence_ + 1
+         && !__atomic_compare_exchange_n(published, &current,
+                                         writing_sequence_ + 1, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  writing_slot_ = NULL;
+}
+
+bool ShmFrameRing::GetNewest(FrameCanvas *canvas, uint64_t *sequence) {
+  RingHeader *header = HeaderOf(memory_);
+  const uint64_t published = __atomic_load_n(&header->published,
+                                             __ATOMIC_ACQUIRE);
+  if (published == *sequence) return false;
+  char *slot = SlotFor(published - 1);
+  const uint64_t complete_state = 2 * (published - 1) + 2;
+  uint64_t *const state = &AsSlot(slot)->state;
+  if (__atomic_load_n(state, __ATOMIC_ACQUIRE) != complete_state)
+    return false;  // Already being overwritten.
+  canvas->SetPixels(0, 0, width_, height_, PixelsOf(slot));
+  // The pixels must be read before checking that they did not change.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(state, __ATOMIC_RELAXED) != complete_state)
+    return false;
+  *sequence = published;
+  return true;
+}
+
+}  // namespace rgb_matrix
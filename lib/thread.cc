@@ -28,7 +28,7 @@ void *Thread::PthreadCallRun(void *tobject) {
   return NULL;
 }
 
-Thread::Thread() : started_(false) {}
+Thread::Thread() : started_(false), realtime_policy_(SCHED_FIFO) {}
 Thread::~Thread() {
   WaitStopped();
 }
@@ -50,7 +50,7 @@ void Thread::Start(int priority, uint32_t affinity_mask) {
   if (priority > 0) {
     struct sched_param p;
     p.sched_priority = priority;
-    if ((err = pthread_setschedparam(thread_, SCHED_FIFO, &p))) {
+    if ((err = pthread_setschedparam(thread_, realtime_policy_, &p))) {
       char buffer[PATH_MAX];
       const char *bin = realpath("/proc/self/exe", buffer);  // Linux specific.
       fprintf(stderr, "Can't set realtime thread priority=%d: %s.\n"
@@ -0,0 +1,110 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Display server: owns the matrix and shows whatever other processes write
+// into a shared memory frame ring (see include/shm-frame-ring.h). So
+// producers don't need to run as root, link this library or know about the
+// panel configuration; they only write RGB pixels.
+
+#include "led-matrix.h"
+#include "shm-frame-ring.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::ShmFrameRing;
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Show frames that other processes write to shared memory.\n");
+  fprintf(stderr, "Options:\n"
+          "\t-n <name>           : Name of the shared memory (Default: /rgbmatrix)\n"
+          "\t-s <slots>          : Frames in the ring (Default: 3)\n"
+          "\t-V <vsync-multiple> : Only swap frames on multiples of refresh (Default: 1)\n");
+  fprintf(stderr, "\nGeneral LED matrix options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  const char *name = "/rgbmatrix";
+  int slots = 3;
+  int vsync_multiple = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:V:")) != -1) {
+    switch (opt) {
+    case 'n': name = optarg; break;
+    case 's': slots = atoi(optarg); break;
+    case 'V': vsync_multiple = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (slots < 2) {
+    fprintf(stderr, "Need at least 2 slots.\n");
+    return usage(argv[0]);
+  }
+  if (vsync_multiple < 1) vsync_multiple = 1;
+
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options,
+                                                   runtime_opt);
+  if (matrix == NULL)
+    return 1;
+
+  ShmFrameRing *ring = ShmFrameRing::Create(name, matrix->width(),
+                                            matrix->height(), slots);
+  if (ring == NULL) {
+    delete matrix;
+    return 1;
+  }
+  fprintf(stderr, "Waiting for %dx%d RGB frames in %s\n",
+          ring->width(), ring->height(), name);
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+  uint64_t sequence = 0;
+  while (!interrupt_received) {
+    if (ring->GetNewest(offscreen, &sequence)) {
+      offscreen = matrix->SwapOnVSync(offscreen, vsync_multiple);
+    } else {
+      usleep(1000);  // Nothing new yet.
+    }
+  }
+
+  matrix->Clear();
+  delete matrix;
+  delete ring;
+  return 0;
+}
@@ -66,6 +66,11 @@ struct FileInfo {
   rgb_matrix::StreamIO *content_stream = nullptr;
 };
 
+// Canvases frames are decoded into ahead of time while playing.
+static const int kPrefetchCanvases = 4;
+static int total_underruns = 0;
+static int total_corrupt_frames = 0;
+
 volatile bool interrupt_received = false;
 static void InterruptHandler(int signo) {
   interrupt_received = true;
@@ -85,25 +90,39 @@ static void SleepMillis(tmillis_t milli_seconds) {
   nanosleep(&ts, NULL);
 }
 
+// Store image in stream; as RGB pixels if "as_rgb", otherwise as canvas.
 static void StoreInStream(const Magick::Image &img, int delay_time_us,
-                          bool do_center,
+                          bool do_center, bool as_rgb,
                           rgb_matrix::FrameCanvas *scratch,
                           rgb_matrix::StreamWriter *output) {
   scratch->Clear();
-  const int x_offset = do_center ? (scratch->width() - img.columns()) / 2 : 0;
-  const int y_offset = do_center ? (scratch->height() - img.rows()) / 2 : 0;
+  const int width = scratch->width();
+  const int height = scratch->height();
+  std::vector<rgb_matrix::Color> pixels(as_rgb ? width * height : 0);
+  const int x_offset = do_center ? (width - img.columns()) / 2 : 0;
+  const int y_offset = do_center ? (height - img.rows()) / 2 : 0;
   for (size_t y = 0; y < img.rows(); ++y) {
     for (size_t x = 0; x < img.columns(); ++x) {
       const Magick::Color &c = img.pixelColor(x, y);
       if (c.alphaQuantum() < 255) {
-        scratch->SetPixel(x + x_offset, y + y_offset,
-                          ScaleQuantumToChar(c.redQuantum()),
-                          ScaleQuantumToChar(c.greenQuantum()),
-                          ScaleQuantumToChar(c.blueQuantum()));
+        const rgb_matrix::Color color(ScaleQuantumToChar(c.redQuantum()),
+                                      ScaleQuantumToChar(c.greenQuantum()),
+                                      ScaleQuantumToChar(c.blueQuantum()));
+        const int px = x + x_offset;
+        const int py = y + y_offset;
+        if (!as_rgb) {
+          scratch->SetPixel(px, py, color.r, color.g, color.b);
+        } else if (px >= 0 && px < width && py >= 0 && py < height) {
+          pixels[py * width + px] = color;
+        }
       }
     }
   }
-  output->Stream(*scratch, delay_time_us);
+  if (as_rgb) {
+    output->StreamRGB(pixels.data(), width, height, delay_time_us);
+  } else {
+    output->Stream(*scratch, delay_time_us);
+  }
 }
 
 static void CopyStream(rgb_matrix::StreamReader *r,
@@ -173,33 +192,44 @@ static bool LoadImageAndScale(const char *filename,
   return true;
 }
 
-void DisplayAnimation(const FileInfo *file,
-                      RGBMatrix *matrix, FrameCanvas *offscreen_canvas) {
-  const tmillis_t duration_ms = (file->is_multi_frame
-                                 ? file->params.anim_duration_ms
-                                 : file->params.wait_ms);
-  rgb_matrix::StreamReader reader(file->content_stream);
-  int loops = file->params.loops;
-  const tmillis_t end_time_ms = GetTimeInMillis() + duration_ms;
-  const tmillis_t override_anim_delay = file->params.anim_delay_ms;
-  for (int k = 0;
-       (loops < 0 || k < loops)
-         && !interrupt_received
-         && GetTimeInMillis() < end_time_ms;
-       ++k) {
-    uint32_t delay_us = 0;
-    while (!interrupt_received && GetTimeInMillis() <= end_time_ms
-           && reader.GetNext(offscreen_canvas, &delay_us)) {
-      const tmillis_t anim_delay_ms =
-        override_anim_delay >= 0 ? override_anim_delay : delay_us / 1000;
-      const tmillis_t start_wait_ms = GetTimeInMillis();
-      offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas,
-                                             file->params.vsync_multiple);
-      const tmillis_t time_already_spent = GetTimeInMillis() - start_wait_ms;
-      SleepMillis(anim_delay_ms - time_already_spent);
-    }
-    reader.Rewind();
+// Show the files one after another as one playlist, looping if "loop" is
+// set. Frames are read ahead into the canvases of the "pool", including the
+// first frames of the next file while the current one is still shown, so
+// there is no gap between files. At the end, the pool contains all canvases
+// but the one displayed.
+void DisplayFiles(const std::vector<FileInfo*> &files, bool loop,
+                  RGBMatrix *matrix, std::vector<FrameCanvas*> *pool) {
+  rgb_matrix::StreamPlaylist playlist(loop);
+  playlist.SetZeroCopy(true);  // Memory or mmap()ed. FileInfos are never freed.
+  for (size_t i = 0; i < files.size(); ++i) {
+    const ImageParams &params = files[i]->params;
+    const tmillis_t duration_ms = (files[i]->is_multi_frame
+                                   ? params.anim_duration_ms
+                                   : params.wait_ms);
+    rgb_matrix::StreamPlaylist::Item item(files[i]->content_stream);
+    item.loops = params.loops;
+    if (duration_ms < distant_future)
+      item.max_duration_us = duration_ms * 1000;
+    if (params.anim_delay_ms >= 0)
+      item.hold_time_us = params.anim_delay_ms * 1000;
+    playlist.Add(item);
+  }
+
+  rgb_matrix::PrefetchingStreamReader prefetcher(&playlist, *pool);
+  pool->clear();
+  uint32_t delay_us = 0;
+  int index = 0;
+  FrameCanvas *frame;
+  while (!interrupt_received && prefetcher.GetNext(&frame, &delay_us, &index)) {
+    const tmillis_t start_wait_ms = GetTimeInMillis();
+    prefetcher.Release(matrix->SwapOnVSync(frame,
+                                           files[index]->params.vsync_multiple));
+    const tmillis_t time_already_spent = GetTimeInMillis() - start_wait_ms;
+    SleepMillis(delay_us / 1000 - time_already_spent);
   }
+  prefetcher.Stop(pool);
+  total_underruns += prefetcher.underruns();
+  total_corrupt_frames += prefetcher.corrupt_frames();
 }
 
 static int usage(const char *progname) {
@@ -208,8 +238,12 @@ static int usage(const char *progname) {
 
   fprintf(stderr, "Options:\n"
           "\t-O<streamfile>            : Output to stream-file instead of matrix (Don't need to be root).\n"
+          "\t-z                        : Compress stream-file written with -O (delta between frames).\n"
+          "\t-A                        : Align frames in stream-file written with -O to memory pages.\n"
+          "\t-p                        : Write stream-file with -O as RGB pixels that play with any panel settings.\n"
           "\t-C                        : Center images.\n"
-          "\t-m                        : if this is a stream, mmap() it. This can work around IO latencies in SD-card and refilling kernel buffers. This will use physical memory so only use if you have enough to map file size\n"
+          "\t-m                        : if this is a stream, mmap() it. This can work around IO latencies in SD-card and refilling kernel buffers. This will use physical memory so only use if you have enough to map file size. Uncompressed frames are then shown without copying.\n"
+          "\t-b<megabytes>             : Memory budget for preloading images; skip remaining files once used up.\n"
 
           "\nThese options affect images FOLLOWING them on the command line,\n"
           "so it is possible to have different options for each image\n"
@@ -283,9 +317,13 @@ int main(int argc, char *argv[]) {
   }
 
   const char *stream_output = NULL;
+  bool do_compress_stream = false;
+  bool do_align_stream = false;
+  bool do_rgb_stream = false;
+  size_t preload_budget = 0;  // Bytes; 0 = unlimited.
 
   int opt;
-  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:V:D:m")) != -1) {
+  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:V:D:mzApb:")) != -1) {
     switch (opt) {
     case 'w':
       img_param.wait_ms = roundf(atof(optarg) * 1000.0f);
@@ -336,6 +374,18 @@ int main(int argc, char *argv[]) {
     case 'O':
       stream_output = strdup(optarg);
       break;
+    case 'z':
+      do_compress_stream = true;
+      break;
+    case 'A':
+      do_align_stream = true;
+      break;
+    case 'p':
+      do_rgb_stream = true;
+      break;
+    case 'b':
+      preload_budget = (size_t)atoi(optarg) << 20;
+      break;
     case 'V':
       img_param.vsync_multiple = atoi(optarg);
       if (img_param.vsync_multiple < 1) img_param.vsync_multiple = 1;
@@ -377,13 +427,18 @@ int main(int argc, char *argv[]) {
   rgb_matrix::StreamIO *stream_io = NULL;
   rgb_matrix::StreamWriter *global_stream_writer = NULL;
   if (stream_output) {
-    int fd = open(stream_output, O_CREAT|O_WRONLY, 0644);
+    int fd = open(stream_output, O_CREAT|O_TRUNC|O_WRONLY, 0644);
     if (fd < 0) {
       perror("Couldn't open output stream");
       return 1;
     }
     stream_io = new rgb_matrix::FileStreamIO(fd);
-    global_stream_writer = new rgb_matrix::StreamWriter(stream_io);
+    global_stream_writer = new rgb_matrix::StreamWriter(stream_io,
+                                                        do_compress_stream);
+    global_stream_writer->SetWriteBuffering(true);
+    if (do_align_stream) {
+      global_stream_writer->SetFrameAlignment(getpagesize());
+    }
   }
 
   const tmillis_t start_load = GetTimeInMillis();
@@ -391,19 +446,34 @@ int main(int argc, char *argv[]) {
   // Preparing all the images beforehand as the Pi might be too slow to
   // be quickly switching between these. So preprocess.
   std::vector<FileInfo*> file_imgs;
+  size_t preload_bytes = 0;
   for (int imgarg = optind; imgarg < argc; ++imgarg) {
     const char *filename = argv[imgarg];
     FileInfo *file_info = NULL;
 
+    if (preload_budget && preload_bytes >= preload_budget) {
+      fprintf(stderr, "Preload budget of %dMiB used up; skipping %d file(s) "
+              "starting with %s\n", (int)(preload_budget >> 20),
+              argc - imgarg, filename);
+      break;
+    }
+
     std::string err_msg;
     std::vector<Magick::Image> image_sequence;
     if (LoadImageAndScale(filename, matrix->width(), matrix->height(),
                           fill_width, fill_height, &image_sequence, &err_msg)) {
       file_info = new FileInfo();
       file_info->params = filename_params[filename];
-      file_info->content_stream = new rgb_matrix::MemStreamIO();
+      rgb_matrix::MemStreamIO *memory_stream = new rgb_matrix::MemStreamIO();
+      file_info->content_stream = memory_stream;
       file_info->is_multi_frame = image_sequence.size() > 1;
       rgb_matrix::StreamWriter out(file_info->content_stream);
+      if (!global_stream_writer) {
+        out.Preallocate(*offscreen_canvas, image_sequence.size());
+      } else if (!do_rgb_stream) {
+        global_stream_writer->Preallocate(*offscreen_canvas,
+                                          image_sequence.size());
+      }
       for (size_t i = 0; i < image_sequence.size(); ++i) {
         const Magick::Image &img = image_sequence[i];
         int64_t delay_time_us;
@@ -413,9 +483,15 @@ int main(int argc, char *argv[]) {
           delay_time_us = file_info->params.wait_ms * 1000;  // single image.
         }
         if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // 1/10sec
-        StoreInStream(img, delay_time_us, do_center, offscreen_canvas,
-                      global_stream_writer ? global_stream_writer : &out);
+        if (global_stream_writer) {
+          StoreInStream(img, delay_time_us, do_center, do_rgb_stream,
+                        offscreen_canvas, global_stream_writer);
+        } else {
+          StoreInStream(img, delay_time_us, do_center, false,
+                        offscreen_canvas, &out);
+        }
       }
+      preload_bytes += memory_stream->MemoryUsage();
     } else {
       // Ok, not an image. Let's see if it is one of our streams.
       int fd = open(filename, O_RDONLY);
@@ -438,8 +514,20 @@ int main(int argc, char *argv[]) {
         if (reader.GetNext(offscreen_canvas, NULL)) {  // header+size ok
           file_info->is_multi_frame = reader.GetNext(offscreen_canvas, NULL);
           reader.Rewind();
-          if (global_stream_writer) {
+          if (global_stream_writer && do_rgb_stream) {
+            fprintf(stderr, "%s: Can't convert streams to RGB, skipping.\n",
+                    filename);
+          } else if (global_stream_writer) {
             CopyStream(&reader, global_stream_writer, offscreen_canvas);
+          } else if (reader.IsRGB()) {
+            // Convert to this panel configuration once instead of with
+            // every frame shown.
+            rgb_matrix::MemStreamIO *converted = new rgb_matrix::MemStreamIO();
+            rgb_matrix::StreamWriter out(converted);
+            CopyStream(&reader, &out, offscreen_canvas);
+            preload_bytes += converted->MemoryUsage();
+            delete file_info->content_stream;
+            file_info->content_stream = converted;
           }
         } else {
           err_msg += "; Can't read as image or compatible stream";
@@ -462,6 +550,7 @@ int main(int argc, char *argv[]) {
   }
 
   if (stream_output) {
+    global_stream_writer->Finalize();  // Index to allow seeking.
     delete global_stream_writer;
     delete stream_io;
     if (file_imgs.size()) {
@@ -501,18 +590,32 @@ int main(int argc, char *argv[]) {
   signal(SIGTERM, InterruptHandler);
   signal(SIGINT, InterruptHandler);
 
+  std::vector<FrameCanvas*> canvas_pool;
+  canvas_pool.push_back(offscreen_canvas);
+  while ((int)canvas_pool.size() < kPrefetchCanvases) {
+    canvas_pool.push_back(matrix->CreateFrameCanvas());
+  }
+
+  // Without shuffling, the playlist loops by itself; otherwise it is
+  // reshuffled after each round.
   do {
     if (do_shuffle) {
       std::random_shuffle(file_imgs.begin(), file_imgs.end());
     }
-    for (size_t i = 0; i < file_imgs.size() && !interrupt_received; ++i) {
-      DisplayAnimation(file_imgs[i], matrix, offscreen_canvas);
-    }
-  } while (do_forever && !interrupt_received);
+    DisplayFiles(file_imgs, do_forever && !do_shuffle, matrix, &canvas_pool);
+  } while (do_forever && do_shuffle && !interrupt_received);
 
   if (interrupt_received) {
     fprintf(stderr, "Caught signal. Exiting.\n");
   }
+  if (total_underruns) {
+    fprintf(stderr, "%d frames were not read in time from storage.\n",
+            total_underruns);
+  }
+  if (total_corrupt_frames) {
+    fprintf(stderr, "%d corrupted frames were skipped.\n",
+            total_corrupt_frames);
+  }
 
   // Animation finished. Shut down the RGB matrix.
   matrix->Clear();
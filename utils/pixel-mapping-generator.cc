@@ -0,0 +1,203 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Create a mapping file for --led-pixel-mapper=File:<file> from a simple
+// description of where each panel is on the canvas, so that arbitrary
+// arrangements (rotated panels, gaps, unused panels) need no code.
+//
+// The description is a text file with these lines; '#' starts a comment:
+//
+//   panel-size <width> <height>   Size of a panel (--led-cols, --led-rows)
+//   chain <n>                     --led-chain
+//   parallel <n>                  --led-parallel (Default: 1)
+//   canvas <width> <height>       Size of the resulting canvas.
+//   <chain> <position> <x> <y> [<rotation>]
+//
+// The last kind of line places a panel: the one at "position" in the
+// parallel "chain" (both counting from 0; position 0 is the panel connected
+// to the Pi) with its top left corner at x,y of the canvas, rotated
+// clockwise by 0, 90, 180 or 270 degrees. Panels not mentioned stay dark,
+// parts of the canvas without panel are not shown.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s <layout-description> <mapping-file>\n",
+          progname);
+  fprintf(stderr, "Create a mapping file for --led-pixel-mapper=File:"
+          "<mapping-file>\n"
+          "See the comment at the top of pixel-mapping-generator.cc "
+          "for the description format.\n");
+  return 1;
+}
+
+// See FilePixelMapper in lib/pixel-mapper.cc
+static const uint32_t kMagicValue = 0x50414D50;
+static const uint16_t kGap = 0xffff;
+struct FileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t matrix_width;
+  uint32_t matrix_height;
+  uint32_t visible_width;
+  uint32_t visible_height;
+  uint32_t reserved[2];
+};
+struct Entry {
+  uint16_t x;
+  uint16_t y;
+};
+
+struct Panel {
+  int chain, position, x, y, rotation;
+  int line;
+};
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) return usage(argv[0]);
+  FILE *in = fopen(argv[1], "r");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  int panel_width = 0, panel_height = 0, chain = 0, parallel = 1;
+  int canvas_width = 0, canvas_height = 0;
+  std::vector<Panel> panels;
+  char line[256];
+  bool ok = true;
+  for (int line_no = 1; fgets(line, sizeof(line), in); ++line_no) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    char word[32];
+    if (sscanf(line, " %31s", word) != 1) continue;  // Empty line.
+    Panel p = { 0, 0, 0, 0, 0, line_no };
+    bool line_ok;
+    if (strcmp(word, "panel-size") == 0) {
+      line_ok = sscanf(line, " %*s %d %d", &panel_width, &panel_height) == 2;
+    } else if (strcmp(word, "chain") == 0) {
+      line_ok = sscanf(line, " %*s %d", &chain) == 1;
+    } else if (strcmp(word, "parallel") == 0) {
+      line_ok = sscanf(line, " %*s %d", &parallel) == 1;
+    } else if (strcmp(word, "canvas") == 0) {
+      line_ok = sscanf(line, " %*s %d %d", &canvas_width, &canvas_height) == 2;
+    } else {
+      line_ok = (sscanf(line, "%d %d %d %d %d", &p.chain, &p.position,
+                        &p.x, &p.y, &p.rotation) >= 4
+                 && p.rotation % 90 == 0 && p.rotation >= 0
+                 && p.rotation < 360);
+      panels.push_back(p);
+    }
+    if (!line_ok) {
+      fprintf(stderr, "%s:%d: can't parse '%s'\n", argv[1], line_no, word);
+      ok = false;
+    }
+  }
+  fclose(in);
+  if (!ok) return 1;
+
+  if (panel_width <= 0 || panel_height <= 0 || chain <= 0 || parallel <= 0
+      || canvas_width <= 0 || canvas_height <= 0) {
+    fprintf(stderr, "Need panel-size, chain and canvas.\n");
+    return 1;
+  }
+  const int matrix_width = panel_width * chain;
+  const int matrix_height = panel_height * parallel;
+  if (matrix_width >= kGap || matrix_height >= kGap) {
+    fprintf(stderr, "Matrix of %dx%d is too large.\n",
+            matrix_width, matrix_height);
+    return 1;
+  }
+
+  std::vector<Entry> mapping((size_t)canvas_width * canvas_height);
+  for (size_t i = 0; i < mapping.size(); ++i) {
+    mapping[i].x = mapping[i].y = kGap;
+  }
+  int clipped = 0;
+  for (size_t i = 0; i < panels.size(); ++i) {
+    const Panel &p = panels[i];
+    if (p.chain < 0 || p.chain >= parallel
+        || p.position < 0 || p.position >= chain) {
+      fprintf(stderr, "%s:%d: no panel %d in chain %d.\n",
+              argv[1], p.line, p.position, p.chain);
+      return 1;
+    }
+    // The first panel in the chain shows the right-most pixels.
+    const int matrix_x = (chain - 1 - p.position) * panel_width;
+    const int matrix_y = p.chain * panel_height;
+    const bool turned = (p.rotation == 90 || p.rotation == 270);
+    const int width = turned ? panel_height : panel_width;
+    const int height = turned ? panel_width : panel_height;
+    for (int ly = 0; ly < height; ++ly) {
+      for (int lx = 0; lx < width; ++lx) {
+        const int x = p.x + lx;
+        const int y = p.y + ly;
+        if (x < 0 || x >= canvas_width || y < 0 || y >= canvas_height) {
+          ++clipped;
+          continue;
+        }
+        int px, py;  // Pixel on the panel.
+        switch (p.rotation) {
+        case 0:   px = lx;                   py = ly;                    break;
+        case 90:  px = ly;                   py = panel_height - 1 - lx; break;
+        case 180: px = panel_width - 1 - lx; py = panel_height - 1 - ly; break;
+        default:  px = panel_width - 1 - ly; py = lx;                    break;
+        }
+        Entry &e = mapping[(size_t)y * canvas_width + x];
+        if (e.x != kGap) {
+          fprintf(stderr, "%s:%d: overlaps another panel at %d,%d.\n",
+                  argv[1], p.line, x, y);
+          return 1;
+        }
+        e.x = matrix_x + px;
+        e.y = matrix_y + py;
+      }
+    }
+  }
+  if (clipped) {
+    fprintf(stderr, "Note: %d panel pixels are outside the canvas.\n",
+            clipped);
+  }
+
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kMagicValue;
+  header.version = 1;
+  header.matrix_width = matrix_width;
+  header.matrix_height = matrix_height;
+  header.visible_width = canvas_width;
+  header.visible_height = canvas_height;
+  FILE *out = fopen(argv[2], "wb");
+  if (out == NULL) {
+    perror(argv[2]);
+    return 1;
+  }
+  const bool written =
+    fwrite(&header, sizeof(header), 1, out) == 1
+    && fwrite(mapping.data(), sizeof(Entry), mapping.size(), out)
+    == mapping.size();
+  if (fclose(out) != 0 || !written) {
+    perror(argv[2]);
+    return 1;
+  }
+  fprintf(stderr, "Wrote %dx%d canvas for --led-cols=%d --led-rows=%d "
+          "--led-chain=%d --led-parallel=%d\n", canvas_width, canvas_height,
+          panel_width, panel_height, chain, parallel);
+  return 0;
+}
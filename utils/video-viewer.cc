@@ -61,17 +61,15 @@ static void InterruptHandler(int) {
   interrupt_received = true;
 }
 
-struct LedPixel {
-  uint8_t r, g, b;
-};
+// The frame is in packed RGB24, which is what rgb_matrix::Color is, so rows
+// can be copied in bulk.
 void CopyFrame(AVFrame *pFrame, FrameCanvas *canvas,
                int offset_x, int offset_y,
                int width, int height) {
   for (int y = 0; y < height; ++y) {
-    LedPixel *pix = (LedPixel*) (pFrame->data[0] + y*pFrame->linesize[0]);
-    for (int x = 0; x < width; ++x, ++pix) {
-      canvas->SetPixel(x + offset_x, y + offset_y, pix->r, pix->g, pix->b);
-    }
+    rgb_matrix::Color *row = reinterpret_cast<rgb_matrix::Color*>(
+      pFrame->data[0] + y*pFrame->linesize[0]);
+    canvas->SetPixels(offset_x, y + offset_y, width, 1, row);
   }
 }
 
@@ -95,6 +93,7 @@ static int usage(const char *progname, const char *msg = NULL) {
   fprintf(stderr, "Options:\n"
           "\t-F                 : Full screen without black bars; aspect ratio might suffer\n"
           "\t-O<streamfile>     : Output to stream-file instead of matrix (don't need to be root).\n"
+          "\t-z                 : Compress stream-file written with -O (delta between frames).\n"
           "\t-s <count>         : Skip these number of frames in the beginning.\n"
           "\t-c <count>         : Only show this number of frames (excluding skipped frames).\n"
           "\t-V<vsync-multiple> : Instead of native video framerate, playback framerate\n"
@@ -178,11 +177,12 @@ int main(int argc, char *argv[]) {
   bool forever = false;
   unsigned thread_count = 1;
   int stream_output_fd = -1;
+  bool compress_stream = false;
   unsigned int frame_skip = 0;
   int64_t framecount_limit = INT64_MAX;
 
   int opt;
-  while ((opt = getopt(argc, argv, "vO:R:Lfc:s:FV:T:")) != -1) {
+  while ((opt = getopt(argc, argv, "vO:R:Lfc:s:FV:T:z")) != -1) {
     switch (opt) {
     case 'v':
       verbose = true;
@@ -190,6 +190,9 @@ int main(int argc, char *argv[]) {
     case 'f':
       forever = true;
       break;
+    case 'z':
+      compress_stream = true;
+      break;
     case 'O':
       stream_output_fd = open(optarg, O_CREAT|O_TRUNC|O_WRONLY, 0644);
       if (stream_output_fd < 0) {
@@ -250,7 +253,8 @@ int main(int argc, char *argv[]) {
   StreamWriter *stream_writer = NULL;
   if (stream_output_fd >= 0) {
     stream_io = new rgb_matrix::FileStreamIO(stream_output_fd);
-    stream_writer = new StreamWriter(stream_io);
+    stream_writer = new StreamWriter(stream_io, compress_stream);
+    stream_writer->SetWriteBuffering(true);
     if (forever) {
       fprintf(stderr, "-f (forever) doesn't make sense with -O; disabling\n");
       forever = false;
@@ -461,6 +465,7 @@ int main(int argc, char *argv[]) {
   }
 
   delete matrix;
+  if (stream_writer) stream_writer->Finalize();  // Index to allow seeking.
   delete stream_writer;
   delete stream_io;
   fprintf(stderr, "Total of %ld frames decoded\n", frame_count);